@@ -0,0 +1,421 @@
+/* Benchmark for the decoder hot paths.
+ *
+ * Times get_pruned_log_probs, ctc_greedy_decoder, ctc_greedy_decoder_batch,
+ * ctc_beam_search_decoder (with and without Scorer), BeamDecoder chunked
+ * streaming and ctc_beam_search_decoder_batch over a grid of beam sizes,
+ * vocabulary sizes, frame counts and thread counts, and reports the real
+ * time factor, frames per second and heap allocations per frame of each
+ * case.
+ *
+ * Posteriors are either seeded synthetic frames or real posterior matrices
+ * stored as 2-D float32 / float64 .npy files (T x V+1, blank last).
+ *
+ * Usage:
+ *     decoder_benchmark [--beam_sizes=8,32,128] [--vocab_sizes=100,1000,5000]
+ *                       [--frames=500] [--threads=1,4] [--batch=8]
+ *                       [--chunk=50] [--cutoff_top_n=40] [--cutoff_prob=1.0]
+ *                       [--frame_ms=40] [--repeat=3] [--seed=1]
+ *                       [--vocab=vocab.txt] [--posteriors=a.npy,b.npy]
+ *                       [--log_posteriors] [--lm=lm.binary --words=words.txt
+ *                        --alpha=0.5 --beta=1.0]
+ *
+ * --vocab replaces the synthetic vocabulary (one token per line, without the
+ * blank) and is required for --posteriors and --lm.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "ctc_greedy_decoder.h"
+#include "decoder_utils.h"
+#include "scorer.h"
+
+// count every heap allocation made while a case runs
+static std::atomic<size_t> num_allocs(0);
+
+void *operator new(size_t size) {
+  ++num_allocs;
+  void *ptr = std::malloc(size ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+typedef std::vector<std::vector<double>> Matrix;
+
+struct Options {
+  std::vector<size_t> beam_sizes = {8, 32, 128};
+  std::vector<size_t> vocab_sizes = {100, 1000, 5000};
+  std::vector<size_t> frames = {500};
+  std::vector<size_t> threads = {1, 4};
+  size_t batch = 8;
+  size_t chunk = 50;
+  size_t cutoff_top_n = 40;
+  double cutoff_prob = 1.0;
+  double frame_ms = 40.0;
+  size_t repeat = 3;
+  unsigned seed = 1;
+  bool log_posteriors = false;
+  std::string vocab_path;
+  std::vector<std::string> posterior_paths;
+  std::string lm_path;
+  std::string words_path;
+  double alpha = 0.5;
+  double beta = 1.0;
+};
+
+static std::vector<size_t> parse_sizes(const std::string &value) {
+  std::vector<size_t> sizes;
+  for (const auto &item : split_str(value, ",")) {
+    sizes.push_back(std::stoul(item));
+  }
+  return sizes;
+}
+
+static Options parse_options(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    std::string key = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (key == "--beam_sizes") {
+      opts.beam_sizes = parse_sizes(value);
+    } else if (key == "--vocab_sizes") {
+      opts.vocab_sizes = parse_sizes(value);
+    } else if (key == "--frames") {
+      opts.frames = parse_sizes(value);
+    } else if (key == "--threads") {
+      opts.threads = parse_sizes(value);
+    } else if (key == "--batch") {
+      opts.batch = std::stoul(value);
+    } else if (key == "--chunk") {
+      opts.chunk = std::stoul(value);
+    } else if (key == "--cutoff_top_n") {
+      opts.cutoff_top_n = std::stoul(value);
+    } else if (key == "--cutoff_prob") {
+      opts.cutoff_prob = std::stod(value);
+    } else if (key == "--frame_ms") {
+      opts.frame_ms = std::stod(value);
+    } else if (key == "--repeat") {
+      opts.repeat = std::stoul(value);
+    } else if (key == "--seed") {
+      opts.seed = std::stoul(value);
+    } else if (key == "--log_posteriors") {
+      opts.log_posteriors = true;
+    } else if (key == "--vocab") {
+      opts.vocab_path = value;
+    } else if (key == "--posteriors") {
+      opts.posterior_paths = split_str(value, ",");
+    } else if (key == "--lm") {
+      opts.lm_path = value;
+    } else if (key == "--words") {
+      opts.words_path = value;
+    } else if (key == "--alpha") {
+      opts.alpha = std::stod(value);
+    } else if (key == "--beta") {
+      opts.beta = std::stod(value);
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      std::exit(1);
+    }
+  }
+  VALID_CHECK(opts.posterior_paths.empty() || !opts.vocab_path.empty(),
+              "--posteriors requires --vocab");
+  VALID_CHECK(opts.lm_path.empty() || !opts.vocab_path.empty(),
+              "--lm requires --vocab");
+  return opts;
+}
+
+// BPE style vocabulary: "▁", word-initial tokens and "##" continuations
+static std::vector<std::string> make_vocabulary(size_t vocab_size) {
+  std::vector<std::string> vocabulary(1, "▁");
+  for (size_t i = 1; i < vocab_size; ++i) {
+    std::string token = "t" + std::to_string(i);
+    vocabulary.push_back(i % 3 == 0 ? "##" + token : token);
+  }
+  return vocabulary;
+}
+
+static std::vector<std::string> load_vocabulary(const std::string &path) {
+  std::vector<std::string> vocabulary;
+  std::ifstream in(path);
+  VALID_CHECK(in.is_open(), "Invalid vocabulary path");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      vocabulary.push_back(line);
+    }
+  }
+  return vocabulary;
+}
+
+/* Peaky CTC-like posteriors: most frames are dominated by the blank, the
+ * others by one token, with log-normal noise over the whole vocabulary.
+ */
+static Matrix make_posteriors(size_t num_frames,
+                              size_t num_classes,
+                              std::mt19937 &rng) {
+  std::normal_distribution<double> noise(0.0, 1.0);
+  std::uniform_int_distribution<size_t> token(0, num_classes - 2);
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  Matrix probs(num_frames, std::vector<double>(num_classes));
+  for (auto &frame : probs) {
+    size_t peak = coin(rng) < 0.6 ? num_classes - 1 : token(rng);
+    double sum = 0.0;
+    for (size_t v = 0; v < num_classes; ++v) {
+      frame[v] = std::exp(noise(rng) + (v == peak ? 8.0 : 0.0));
+      sum += frame[v];
+    }
+    for (auto &p : frame) {
+      p /= sum;
+    }
+  }
+  return probs;
+}
+
+// minimal reader for 2-D little-endian float32 / float64 .npy files
+static Matrix load_npy(const std::string &path, bool log_posteriors) {
+  std::ifstream in(path, std::ios::binary);
+  VALID_CHECK(in.is_open(), "Invalid posterior path");
+  char magic[8];
+  in.read(magic, 8);
+  VALID_CHECK(in && std::memcmp(magic, "\x93NUMPY", 6) == 0,
+              "Posterior file is not a .npy file");
+  uint32_t header_len = 0;
+  if (magic[6] == 1) {
+    unsigned char len[2];
+    in.read(reinterpret_cast<char *>(len), 2);
+    header_len = len[0] | (len[1] << 8);
+  } else {
+    unsigned char len[4];
+    in.read(reinterpret_cast<char *>(len), 4);
+    header_len = len[0] | (len[1] << 8) | (len[2] << 16) | (len[3] << 24);
+  }
+  std::string header(header_len, ' ');
+  in.read(&header[0], header_len);
+
+  bool is_float = header.find("'<f4'") != std::string::npos;
+  VALID_CHECK(is_float || header.find("'<f8'") != std::string::npos,
+              "Posteriors must be float32 or float64");
+  VALID_CHECK(header.find("'fortran_order': False") != std::string::npos,
+              "Posteriors must be stored in C order");
+  size_t shape_pos = header.find('(', header.find("'shape'"));
+  std::vector<std::string> dims = split_str(
+      header.substr(shape_pos + 1, header.find(')', shape_pos) - shape_pos - 1),
+      ",");
+  VALID_CHECK_EQ(dims.size(), 2, "Posteriors must be 2-D");
+  size_t num_frames = std::stoul(dims[0]);
+  size_t num_classes = std::stoul(dims[1]);
+  VALID_CHECK_GT(num_frames, 0, "Posteriors have no frames");
+  VALID_CHECK_GT(num_classes, 0, "Posteriors have no classes");
+
+  Matrix probs(num_frames, std::vector<double>(num_classes));
+  std::vector<char> row(num_classes * (is_float ? 4 : 8));
+  for (auto &frame : probs) {
+    in.read(row.data(), row.size());
+    VALID_CHECK(static_cast<bool>(in), "Truncated posterior file");
+    for (size_t v = 0; v < num_classes; ++v) {
+      if (is_float) {
+        float value;
+        std::memcpy(&value, row.data() + 4 * v, 4);
+        frame[v] = value;
+      } else {
+        std::memcpy(&frame[v], row.data() + 8 * v, 8);
+      }
+      if (log_posteriors) {
+        frame[v] = std::exp(frame[v]);
+      }
+    }
+  }
+  return probs;
+}
+
+struct Case {
+  std::string name;
+  size_t beam_size;
+  size_t vocab_size;
+  size_t threads;
+};
+
+// run fn repeat times and report the best run
+template <typename Fn>
+static void run_case(const Case &c,
+                     size_t num_frames,
+                     const Options &opts,
+                     Fn fn) {
+  double best = std::numeric_limits<double>::max();
+  size_t allocs = 0;
+  for (size_t r = 0; r < std::max<size_t>(opts.repeat, 1); ++r) {
+    size_t allocs_before = num_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (elapsed.count() < best) {
+      best = elapsed.count();
+      allocs = num_allocs.load() - allocs_before;
+    }
+  }
+  double audio_seconds = num_frames * opts.frame_ms / 1000.0;
+  printf("%-16s %6zu %6zu %7zu %4zu %10.4f %8.4f %12.1f %10.2f\n",
+         c.name.c_str(),
+         c.beam_size,
+         c.vocab_size,
+         num_frames,
+         c.threads,
+         best,
+         best / audio_seconds,
+         num_frames / best,
+         static_cast<double>(allocs) / num_frames);
+  fflush(stdout);
+}
+
+static void run_suite(const std::vector<Matrix> &utterances,
+                      const std::vector<std::string> &vocabulary,
+                      Scorer *scorer,
+                      const Options &opts) {
+  size_t vocab_size = vocabulary.size();
+  size_t num_frames = 0;
+  for (const auto &utt : utterances) {
+    num_frames += utt.size();
+  }
+  std::vector<std::string> vocabulary_blank(vocabulary);
+  vocabulary_blank.push_back("<blank>");
+
+  run_case({"prune", 0, vocab_size, 1}, num_frames, opts, [&]() {
+    for (const auto &utt : utterances) {
+      for (const auto &frame : utt) {
+        get_pruned_log_probs(frame, opts.cutoff_prob, opts.cutoff_top_n);
+      }
+    }
+  });
+  run_case({"greedy", 0, vocab_size, 1}, num_frames, opts, [&]() {
+    for (const auto &utt : utterances) {
+      ctc_greedy_decoder(utt, vocabulary);
+    }
+  });
+  // the same frames as one contiguous float buffer
+  std::vector<float> flat_probs;
+  std::vector<int> utterance_offsets(1, 0);
+  for (const auto &utt : utterances) {
+    for (const auto &frame : utt) {
+      flat_probs.insert(flat_probs.end(), frame.begin(), frame.end());
+    }
+    utterance_offsets.push_back(utterance_offsets.back() + utt.size());
+  }
+  for (size_t threads : opts.threads) {
+    run_case({"greedy_batch", 0, vocab_size, threads}, num_frames, opts,
+             [&]() {
+      ctc_greedy_decoder_batch(
+          flat_probs, utterance_offsets, vocabulary, threads);
+    });
+  }
+
+  for (size_t beam_size : opts.beam_sizes) {
+    run_case({"beam", beam_size, vocab_size, 1}, num_frames, opts, [&]() {
+      for (const auto &utt : utterances) {
+        ctc_beam_search_decoder(utt, vocabulary, beam_size, opts.cutoff_prob,
+                                opts.cutoff_top_n, nullptr);
+      }
+    });
+    if (scorer != nullptr) {
+      run_case({"beam_lm", beam_size, vocab_size, 1}, num_frames, opts, [&]() {
+        for (const auto &utt : utterances) {
+          ctc_beam_search_decoder(utt, vocabulary, beam_size,
+                                  opts.cutoff_prob, opts.cutoff_top_n, scorer);
+        }
+      });
+    }
+    run_case({"stream", beam_size, vocab_size, 1}, num_frames, opts, [&]() {
+      BeamDecoder decoder(vocabulary_blank, beam_size, opts.cutoff_prob,
+                          opts.cutoff_top_n, nullptr);
+      for (const auto &utt : utterances) {
+        for (size_t start = 0; start < utt.size(); start += opts.chunk) {
+          size_t end = std::min(start + opts.chunk, utt.size());
+          Matrix chunk(utt.begin() + start, utt.begin() + end);
+          decoder.decode(chunk);
+        }
+        decoder.reset();
+      }
+    });
+    for (size_t threads : opts.threads) {
+      std::vector<Matrix> batch;
+      while (batch.size() < std::max(opts.batch, utterances.size())) {
+        batch.push_back(utterances[batch.size() % utterances.size()]);
+      }
+      size_t batch_frames = 0;
+      for (const auto &utt : batch) {
+        batch_frames += utt.size();
+      }
+      run_case({scorer ? "batch_lm" : "batch", beam_size, vocab_size, threads},
+               batch_frames, opts, [&]() {
+        ctc_beam_search_decoder_batch(batch, vocabulary, beam_size, threads,
+                                      opts.cutoff_prob, opts.cutoff_top_n,
+                                      scorer);
+      });
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  Options opts = parse_options(argc, argv);
+  printf("%-16s %6s %6s %7s %4s %10s %8s %12s %10s\n", "case", "beam",
+         "vocab", "frames", "thr", "seconds", "rtf", "frames/s",
+         "allocs/fr");
+
+  std::mt19937 rng(opts.seed);
+  if (!opts.vocab_path.empty()) {
+    std::vector<std::string> vocabulary = load_vocabulary(opts.vocab_path);
+    std::unique_ptr<Scorer> scorer;
+    if (!opts.lm_path.empty()) {
+      scorer.reset(new Scorer(opts.alpha, opts.beta, opts.lm_path,
+                              opts.words_path, vocabulary));
+    }
+    std::vector<Matrix> utterances;
+    for (const auto &path : opts.posterior_paths) {
+      utterances.push_back(load_npy(path, opts.log_posteriors));
+      VALID_CHECK_EQ(utterances.back()[0].size(), vocabulary.size() + 1,
+                     "Posteriors do not match the vocabulary");
+    }
+    if (utterances.empty()) {
+      for (size_t num_frames : opts.frames) {
+        utterances.assign(
+            1, make_posteriors(num_frames, vocabulary.size() + 1, rng));
+        run_suite(utterances, vocabulary, scorer.get(), opts);
+      }
+    } else {
+      run_suite(utterances, vocabulary, scorer.get(), opts);
+    }
+    return 0;
+  }
+
+  for (size_t vocab_size : opts.vocab_sizes) {
+    std::vector<std::string> vocabulary = make_vocabulary(vocab_size);
+    for (size_t num_frames : opts.frames) {
+      std::vector<Matrix> utterances(
+          1, make_posteriors(num_frames, vocab_size + 1, rng));
+      run_suite(utterances, vocabulary, nullptr, opts);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+"""Perf regression harness comparing two builds of the decoders.
+
+Decodes a fixed corpus of stored posteriors with a fixed LM and lexicon,
+records throughput, peak RSS and the top-N outputs of every utterance, and
+diffs two such runs on speed and on exact output (scores within tolerance).
+
+A corpus is a directory holding:
+    vocab.txt      one token per line, without the blank
+    *.npy          2-D posterior matrices (T x V+1, blank last)
+    lm.binary      optional KenLM model, decoding without LM if absent
+    words.txt      word map of the lexicon, required with lm.binary
+
+Example:
+    python benchmark/regression.py run --module_dir build_a --corpus corpus \
+        --out a.json
+    python benchmark/regression.py run --module_dir build_b --corpus corpus \
+        --out b.json
+    python benchmark/regression.py compare a.json b.json
+
+Each run happens in its own process, so the build is picked by the
+directory holding _swig_decoders and swig_decoders.py, and peak RSS covers
+one build only.
+"""
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import argparse
+import glob
+import json
+import os
+import resource
+import sys
+import time
+
+import numpy as np
+
+
+def load_corpus(corpus_dir, log_posteriors):
+    with open(os.path.join(corpus_dir, 'vocab.txt')) as f:
+        vocabulary = [line.rstrip('\n') for line in f if line.rstrip('\n')]
+    utterances = []
+    for path in sorted(glob.glob(os.path.join(corpus_dir, '*.npy'))):
+        probs = np.load(path).astype(np.float64)
+        if log_posteriors:
+            probs = np.exp(probs)
+        if probs.ndim != 2 or probs.shape[1] != len(vocabulary) + 1:
+            raise ValueError('%s does not match the vocabulary' % path)
+        name = os.path.splitext(os.path.basename(path))[0]
+        utterances.append((name, probs.tolist()))
+    if not utterances:
+        raise ValueError('No posteriors found in %s' % corpus_dir)
+    return vocabulary, utterances
+
+
+def run(args):
+    if args.module_dir:
+        sys.path.insert(0, os.path.abspath(args.module_dir))
+    import swig_decoders
+
+    vocabulary, utterances = load_corpus(args.corpus, args.log_posteriors)
+    scorer = None
+    lm_path = os.path.join(args.corpus, 'lm.binary')
+    if os.path.exists(lm_path):
+        scorer = swig_decoders.Scorer(args.alpha, args.beta, lm_path,
+                                      os.path.join(args.corpus, 'words.txt'),
+                                      vocabulary)
+
+    num_frames = sum(len(probs) for _, probs in utterances)
+    best_seconds = None
+    results = None
+    for _ in range(max(args.repeat, 1)):
+        start = time.time()
+        if args.num_processes > 1:
+            beams = swig_decoders.ctc_beam_search_decoder_batch(
+                [probs for _, probs in utterances], vocabulary,
+                args.beam_size, args.num_processes, args.cutoff_prob,
+                args.cutoff_top_n, scorer)
+        else:
+            beams = [
+                swig_decoders.ctc_beam_search_decoder(
+                    probs, vocabulary, args.beam_size, args.cutoff_prob,
+                    args.cutoff_top_n, scorer) for _, probs in utterances
+            ]
+        seconds = time.time() - start
+        if best_seconds is None or seconds < best_seconds:
+            best_seconds = seconds
+        results = beams
+
+    report = {
+        'module_dir': os.path.abspath(args.module_dir or '.'),
+        'corpus': os.path.abspath(args.corpus),
+        'params': {
+            'beam_size': args.beam_size,
+            'cutoff_prob': args.cutoff_prob,
+            'cutoff_top_n': args.cutoff_top_n,
+            'alpha': args.alpha,
+            'beta': args.beta,
+            'num_processes': args.num_processes,
+            'use_lm': scorer is not None,
+        },
+        'utterances': len(utterances),
+        'frames': num_frames,
+        'seconds': best_seconds,
+        'frames_per_second': num_frames / best_seconds,
+        # kilobytes on Linux, bytes on macOS
+        'peak_rss': resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+        'results': {
+            name: [[res[0], res[1]] for res in beam[:args.top_n]]
+            for (name, _), beam in zip(utterances, results)
+        },
+    }
+    with open(args.out, 'w') as f:
+        json.dump(report, f, indent=1, ensure_ascii=False)
+    print('%d utterances, %d frames in %.3fs: %.1f frames/s, peak RSS %d' %
+          (len(utterances), num_frames, best_seconds,
+           report['frames_per_second'], report['peak_rss']))
+    return 0
+
+
+def compare(args):
+    with open(args.baseline) as f:
+        base = json.load(f)
+    with open(args.candidate) as f:
+        cand = json.load(f)
+    if base['params'] != cand['params']:
+        print('Runs used different parameters:\n  %s\n  %s' %
+              (base['params'], cand['params']))
+        return 1
+
+    mismatches = 0
+    for name in sorted(set(base['results']) | set(cand['results'])):
+        base_beam = base['results'].get(name)
+        cand_beam = cand['results'].get(name)
+        if base_beam is None or cand_beam is None:
+            print('%s: missing in one run' % name)
+            mismatches += 1
+            continue
+        for rank in range(max(len(base_beam), len(cand_beam))):
+            if rank >= len(base_beam) or rank >= len(cand_beam):
+                print('%s: %d vs %d hypotheses' %
+                      (name, len(base_beam), len(cand_beam)))
+                mismatches += 1
+                break
+            base_score, base_text = base_beam[rank]
+            cand_score, cand_text = cand_beam[rank]
+            if (base_text != cand_text or
+                    abs(base_score - cand_score) > args.score_tol):
+                print('%s #%d:\n  %.4f %s\n  %.4f %s' %
+                      (name, rank, base_score, base_text, cand_score,
+                       cand_text))
+                mismatches += 1
+
+    speedup = cand['frames_per_second'] / base['frames_per_second']
+    print('frames/s: %.1f -> %.1f (x%.3f)' %
+          (base['frames_per_second'], cand['frames_per_second'], speedup))
+    print('peak RSS: %d -> %d' % (base['peak_rss'], cand['peak_rss']))
+    print('%d mismatching hypotheses' % mismatches)
+
+    if mismatches > 0:
+        return 1
+    if args.max_slowdown is not None and speedup < 1.0 - args.max_slowdown:
+        print('Slowdown beyond %.1f%%' % (100 * args.max_slowdown))
+        return 1
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    subparsers = parser.add_subparsers(dest='command')
+
+    run_parser = subparsers.add_parser('run', help='Decode the corpus.')
+    run_parser.add_argument('--module_dir', default='',
+                            help='Directory of the _swig_decoders build.')
+    run_parser.add_argument('--corpus', required=True)
+    run_parser.add_argument('--out', required=True)
+    run_parser.add_argument('--beam_size', type=int, default=64)
+    run_parser.add_argument('--cutoff_prob', type=float, default=1.0)
+    run_parser.add_argument('--cutoff_top_n', type=int, default=40)
+    run_parser.add_argument('--alpha', type=float, default=0.5)
+    run_parser.add_argument('--beta', type=float, default=1.0)
+    run_parser.add_argument('--num_processes', type=int, default=1,
+                            help='Use the batch decoder when above 1.')
+    run_parser.add_argument('--top_n', type=int, default=5,
+                            help='Hypotheses recorded per utterance.')
+    run_parser.add_argument('--repeat', type=int, default=3,
+                            help='Decode the corpus this many times and '
+                            'report the fastest pass.')
+    run_parser.add_argument('--log_posteriors', action='store_true')
+
+    compare_parser = subparsers.add_parser('compare',
+                                           help='Diff two run reports.')
+    compare_parser.add_argument('baseline')
+    compare_parser.add_argument('candidate')
+    compare_parser.add_argument('--score_tol', type=float, default=1e-3)
+    compare_parser.add_argument('--max_slowdown', type=float, default=None,
+                                help='Fail if throughput drops by more than '
+                                'this fraction.')
+
+    args = parser.parse_args()
+    if args.command == 'run':
+        return run(args)
+    if args.command == 'compare':
+        return compare(args)
+    parser.print_help()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,139 @@
+#include "context_biasing.h"
+
+#include <algorithm>
+#include <map>
+
+#include "decoder_utils.h"
+
+ContextBiasing::ContextBiasing(const std::vector<std::vector<int>> &phrases,
+                               const std::vector<float> &boosts) {
+  VALID_CHECK_EQ(phrases.size(),
+                 boosts.size(),
+                 "Every phrase needs one boost");
+  build(phrases, boosts);
+}
+
+ContextBiasing::ContextBiasing(const std::vector<std::vector<int>> &phrases,
+                               float boost) {
+  build(phrases, std::vector<float>(phrases.size(), boost));
+}
+
+void ContextBiasing::build(const std::vector<std::vector<int>> &phrases,
+                           const std::vector<float> &boosts) {
+  // trie of the phrases, a shared prefix taking the largest boost
+  std::vector<std::map<int, int>> children(1);
+  std::vector<float> boost(1, 0.0);
+  std::vector<bool> is_end(1, false);
+  num_phrases_ = 0;
+  for (size_t i = 0; i < phrases.size(); ++i) {
+    if (phrases[i].empty()) {
+      continue;
+    }
+    int state = 0;
+    for (int token : phrases[i]) {
+      VALID_CHECK(token >= 0, "Invalid token id in biasing phrase");
+      auto it = children[state].find(token);
+      if (it == children[state].end()) {
+        it = children[state].emplace(token, children.size()).first;
+        children.emplace_back();
+        boost.push_back(boosts[i]);
+        is_end.push_back(false);
+      }
+      state = it->second;
+      boost[state] = std::max(boost[state], boosts[i]);
+    }
+    is_end[state] = true;
+    ++num_phrases_;
+  }
+
+  // flatten the children and link the failures breadth first
+  size_t num_states = children.size();
+  first_child_.assign(num_states + 1, 0);
+  fail_.assign(num_states, 0);
+  score_.assign(num_states, 0.0);
+  output_score_.assign(num_states, 0.0);
+  std::vector<int> queue(1, 0);
+  for (size_t head = 0; head < queue.size(); ++head) {
+    int state = queue[head];
+    for (auto &child : children[state]) {
+      int token = child.first, next = child.second;
+      score_[next] = score_[state] + boost[next];
+      if (state != 0) {
+        int fail = fail_[state];
+        while (fail != 0 && children[fail].count(token) == 0) {
+          fail = fail_[fail];
+        }
+        auto it = children[fail].find(token);
+        fail_[next] = it != children[fail].end() ? it->second : 0;
+      }
+      // the failure state is shallower, so it is done already
+      output_score_[next] =
+          is_end[next] ? score_[next] : output_score_[fail_[next]];
+      queue.push_back(next);
+    }
+  }
+  for (size_t s = 0; s < num_states; ++s) {
+    first_child_[s + 1] = first_child_[s] + children[s].size();
+    for (auto &child : children[s]) {
+      child_token_.push_back(child.first);
+      child_state_.push_back(child.second);
+    }
+  }
+}
+
+int ContextBiasing::find_child(int state, int token) const {
+  auto begin = child_token_.begin() + first_child_[state];
+  auto end = child_token_.begin() + first_child_[state + 1];
+  auto it = std::lower_bound(begin, end, token);
+  if (it == end || *it != token) {
+    return -1;
+  }
+  return child_state_[it - child_token_.begin()];
+}
+
+void ContextBiasing::advance(const PathTrie &prefix,
+                             int token,
+                             PathTrie &prefix_new) const {
+  // prefixes older than the biasing start from scratch
+  bool known = prefix.bias_state >= 0 &&
+               static_cast<size_t>(prefix.bias_state) < num_states();
+  int state = known ? prefix.bias_state : 0;
+  float base = known ? prefix.bias_base : 0.0;
+  float partial = score_[state] - base;
+
+  int next = find_child(state, token);
+  float gain;
+  if (next < 0) {
+    // the match failed, the boosts already committed stay with the
+    // completed phrases and the fallback match earns its own; a phrase
+    // completed within the fallback state is earned again by it, so its
+    // committed boost moves into the new match rather than counting twice
+    int fallback = state;
+    while (next < 0 && fallback != 0) {
+      fallback = fail_[fallback];
+      next = find_child(fallback, token);
+    }
+    float reearned = 0.0;
+    if (next < 0) {
+      next = 0;
+    } else {
+      reearned = std::min(base, output_score_[fallback]);
+    }
+    gain = score_[next] - partial - reearned;
+    base = std::max(output_score_[next], reearned);
+  } else {
+    gain = score_[next] - score_[state];
+    base = std::max(base, output_score_[next]);
+  }
+  prefix_new.bias_state = next;
+  prefix_new.bias_base = base;
+  prefix_new.bias_score = prefix.bias_score + gain;
+}
+
+float ContextBiasing::partial_score(const PathTrie &prefix) const {
+  if (prefix.bias_state < 0 ||
+      static_cast<size_t>(prefix.bias_state) >= num_states()) {
+    return 0.0;
+  }
+  return score_[prefix.bias_state] - prefix.bias_base;
+}
@@ -0,0 +1,64 @@
+#ifndef CONTEXT_BIASING_H_
+#define CONTEXT_BIASING_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "path_trie.h"
+
+/* Contextual biasing of the beam search towards a set of phrases, e.g.
+ * contact names or product terms, given as token id sequences.
+ *
+ * The phrases form an Aho-Corasick automaton walked alongside the prefixes:
+ * every token extending a partial match earns its phrase's boost, a failed
+ * match falls back to the longest phrase prefix that is a suffix of the
+ * prefix and gives back the boosts it no longer earns, and a completed
+ * phrase keeps its boosts for good, also one completed as a suffix of a
+ * longer partial match. The automaton is immutable once built, so one
+ * instance can bias concurrent decodes.
+ *
+ * Example:
+ *     ContextBiasing biasing({{12, 7, 30}, {5, 44}}, 2.0);
+ *     ctc_beam_search_decoder(..., &biasing);
+ */
+class ContextBiasing {
+public:
+  // one boost per phrase, or a single one for all
+  ContextBiasing(const std::vector<std::vector<int>> &phrases,
+                 const std::vector<float> &boosts);
+  ContextBiasing(const std::vector<std::vector<int>> &phrases, float boost);
+
+  size_t num_phrases() const { return num_phrases_; }
+  size_t num_states() const { return score_.size(); }
+
+#ifndef SWIG
+  // set the biasing state and score of prefix_new, prefix extended by token
+  void advance(const PathTrie &prefix, int token, PathTrie &prefix_new) const;
+
+  // boost of the partial match at the end of a prefix, to take back when
+  // the prefix is final
+  float partial_score(const PathTrie &prefix) const;
+#endif
+
+private:
+  void build(const std::vector<std::vector<int>> &phrases,
+             const std::vector<float> &boosts);
+
+  // child of state for token, or -1
+  int find_child(int state, int token) const;
+
+  size_t num_phrases_;
+  // children of state s are child_token_/child_state_ in
+  // [first_child_[s], first_child_[s + 1]), sorted by token
+  std::vector<size_t> first_child_;
+  std::vector<int> child_token_;
+  std::vector<int> child_state_;
+  std::vector<int> fail_;
+  // sum of the boosts from the start state
+  std::vector<float> score_;
+  // score of the longest phrase ending at the state, the state's own or
+  // one reached by failure links, 0 if none
+  std::vector<float> output_score_;
+};
+
+#endif  // CONTEXT_BIASING_H_
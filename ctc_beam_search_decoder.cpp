@@ -11,47 +11,259 @@
 #include "fst/fstlib.h"
 
 #include "decoder_utils.h"
+#include "error_rate.h"
+#include "lattice.h"
 #include "path_trie.h"
+#include "posterior_file.h"
 
 using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
 
-std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
-    const std::vector<std::vector<double>> &probs_seq,
+namespace {
+
+// Dense frames of probabilities, pruned as the search consumes them.
+class DenseFrames {
+public:
+  DenseFrames(const std::vector<std::vector<double>> &probs_seq,
+              size_t blank_id,
+              double cutoff_prob,
+              size_t cutoff_top_n)
+      : probs_seq_(probs_seq),
+        blank_id_(blank_id),
+        cutoff_prob_(cutoff_prob),
+        cutoff_top_n_(cutoff_top_n) {}
+
+  size_t size() const { return probs_seq_.size(); }
+
+  // fill the pruned (token, log prob) pairs of frame t and return the log
+  // prob of the blank before pruning
+  double get(size_t t,
+             std::vector<std::pair<size_t, float>> &log_prob_idx) const {
+    log_prob_idx =
+        get_pruned_log_probs(probs_seq_[t], cutoff_prob_, cutoff_top_n_);
+    return std::log(probs_seq_[t][blank_id_]);
+  }
+
+private:
+  const std::vector<std::vector<double>> &probs_seq_;
+  size_t blank_id_;
+  double cutoff_prob_;
+  size_t cutoff_top_n_;
+};
+
+// Sparse frames in CSR form: frame t holds the (token_ids[i], log_probs[i])
+// for i in [row_offsets[first_row + t], row_offsets[first_row + t + 1]).
+// They are already cut down by the acoustic model, so there is no dense
+// row to build and pruning only runs when cutoff_prob asks for it.
+class SparseFrames {
+public:
+  SparseFrames(const std::vector<int> &token_ids,
+               const std::vector<float> &log_probs,
+               const std::vector<int> &row_offsets,
+               size_t first_row,
+               size_t last_row,
+               size_t num_classes,
+               size_t blank_id,
+               double cutoff_prob,
+               size_t cutoff_top_n)
+      : token_ids_(token_ids),
+        log_probs_(log_probs),
+        row_offsets_(row_offsets),
+        first_row_(first_row),
+        num_rows_(last_row - first_row),
+        blank_id_(blank_id),
+        cutoff_prob_(cutoff_prob),
+        cutoff_top_n_(cutoff_top_n) {
+    VALID_CHECK_EQ(token_ids.size(),
+                   log_probs.size(),
+                   "token_ids and log_probs must have the same size");
+    VALID_CHECK(first_row <= last_row && last_row < row_offsets.size(),
+                "Frames out of the range of row_offsets");
+    for (size_t t = first_row; t < last_row; ++t) {
+      VALID_CHECK(row_offsets[t] >= 0 && row_offsets[t] <= row_offsets[t + 1],
+                  "row_offsets must be nondecreasing");
+      VALID_CHECK(static_cast<size_t>(row_offsets[t + 1]) <= token_ids.size(),
+                  "row_offsets out of the range of token_ids");
+      bool has_blank = false;
+      for (int i = row_offsets[t]; i < row_offsets[t + 1]; ++i) {
+        VALID_CHECK(token_ids[i] >= 0 &&
+                        static_cast<size_t>(token_ids[i]) < num_classes,
+                    "The token ids do not match with the vocabulary");
+        has_blank |= static_cast<size_t>(token_ids[i]) == blank_id;
+      }
+      VALID_CHECK(has_blank, "Every sparse frame must hold the blank");
+    }
+  }
+
+  size_t size() const { return num_rows_; }
+
+  double get(size_t t,
+             std::vector<std::pair<size_t, float>> &log_prob_idx) const {
+    double log_prob_blank = -NUM_FLT_INF;
+    log_prob_idx.clear();
+    for (int i = row_offsets_[first_row_ + t];
+         i < row_offsets_[first_row_ + t + 1];
+         ++i) {
+      log_prob_idx.emplace_back(token_ids_[i], log_probs_[i]);
+      if (static_cast<size_t>(token_ids_[i]) == blank_id_) {
+        log_prob_blank = log_probs_[i];
+      }
+    }
+    prune_log_prob_idx(log_prob_idx, cutoff_prob_, cutoff_top_n_);
+    return log_prob_blank;
+  }
+
+private:
+  const std::vector<int> &token_ids_;
+  const std::vector<float> &log_probs_;
+  const std::vector<int> &row_offsets_;
+  size_t first_row_;
+  size_t num_rows_;
+  size_t blank_id_;
+  double cutoff_prob_;
+  size_t cutoff_top_n_;
+};
+
+// Dense frames pruned once up front, so that many searches over the same
+// utterance skip the pruning and logging of every frame.
+class CachedFrames {
+public:
+  CachedFrames(const std::vector<std::vector<double>> &probs_seq,
+               size_t blank_id,
+               double cutoff_prob,
+               size_t cutoff_top_n) {
+    DenseFrames frames(probs_seq, blank_id, cutoff_prob, cutoff_top_n);
+    std::vector<std::pair<size_t, float>> log_prob_idx;
+    row_offsets_.push_back(0);
+    for (size_t t = 0; t < frames.size(); ++t) {
+      log_prob_blank_.push_back(frames.get(t, log_prob_idx));
+      log_prob_idx_.insert(
+          log_prob_idx_.end(), log_prob_idx.begin(), log_prob_idx.end());
+      row_offsets_.push_back(log_prob_idx_.size());
+    }
+  }
+
+  size_t size() const { return log_prob_blank_.size(); }
+
+  double get(size_t t,
+             std::vector<std::pair<size_t, float>> &log_prob_idx) const {
+    log_prob_idx.assign(log_prob_idx_.begin() + row_offsets_[t],
+                        log_prob_idx_.begin() + row_offsets_[t + 1]);
+    return log_prob_blank_[t];
+  }
+
+private:
+  std::vector<std::pair<size_t, float>> log_prob_idx_;
+  std::vector<size_t> row_offsets_;
+  std::vector<double> log_prob_blank_;
+};
+
+// The frames [first, first + size) of another frame source.
+template <typename Frames>
+class FrameWindow {
+public:
+  FrameWindow(const Frames &frames, size_t first, size_t size)
+      : frames_(frames), first_(first), size_(size) {}
+
+  size_t size() const { return size_; }
+
+  double get(size_t t,
+             std::vector<std::pair<size_t, float>> &log_prob_idx) const {
+    return frames_.get(first_ + t, log_prob_idx);
+  }
+
+private:
+  const Frames &frames_;
+  size_t first_;
+  size_t size_;
+};
+
+}  // namespace
+
+// split the scores of the first num_prefixes prefixes, whose approx_ctc
+// is up to date
+static void fill_hypothesis_scores(const std::vector<PathTrie *> &prefixes,
+                                   size_t num_prefixes,
+                                   std::vector<HypothesisScore> &scores) {
+  scores.resize(num_prefixes);
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    scores[i].acoustic = prefixes[i]->approx_ctc;
+    scores[i].lm = prefixes[i]->lm_log_prob;
+    scores[i].num_words = prefixes[i]->num_words;
+    scores[i].bias = prefixes[i]->bias_score;
+  }
+}
+
+// flatten the first num_prefixes prefixes, which are sorted
+static void fill_beam_results(const std::vector<PathTrie *> &prefixes,
+                              size_t num_prefixes,
+                              BeamResults &results) {
+  results.scores.clear();
+  results.tokens.clear();
+  results.frames.clear();
+  results.offsets.assign(1, 0);
+  std::vector<int> output;
+  std::vector<uint32_t> timestamps;
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    prefixes[i]->get_path_vec2(output, &timestamps);
+    results.scores.push_back(prefixes[i]->score);
+    results.tokens.insert(results.tokens.end(), output.begin(), output.end());
+    results.frames.insert(
+        results.frames.end(), timestamps.begin(), timestamps.end());
+    results.offsets.push_back(results.tokens.size());
+  }
+}
+
+std::vector<int> BeamResults::get_tokens(size_t i) const {
+  VALID_CHECK_LT(i, size(), "Hypothesis index out of range");
+  return std::vector<int>(tokens.begin() + offsets[i],
+                          tokens.begin() + offsets[i + 1]);
+}
+
+std::string BeamResults::get_text(
+    size_t i, const std::vector<std::string> &vocabulary) const {
+  return get_text(i, Detokenizer(vocabulary));
+}
+
+std::string BeamResults::get_text(size_t i,
+                                  const Detokenizer &detokenizer) const {
+  VALID_CHECK_LT(i, size(), "Hypothesis index out of range");
+  std::string text;
+  detokenizer.append(
+      tokens.data() + offsets[i], offsets[i + 1] - offsets[i], text);
+  return text;
+}
+
+// prefix beam search over any frame source with the interface of
+// DenseFrames. The prefixes are start and the nodes the search adds under
+// it, the words on the path to start only serving as LM context. Return
+// the number of prefixes kept, sorted first in prefixes.
+template <typename Frames>
+static size_t ctc_prefix_search(
+    const Frames &frames,
     const std::vector<std::string> &vocabulary,
     size_t beam_size,
-    double cutoff_prob,
-    size_t cutoff_top_n,
-    Scorer *ext_scorer) {
-  // dimension check
-  std::vector<std::tuple<std::string, uint32_t, uint32_t>> wordlist;
-  size_t num_time_steps = probs_seq.size();
-  for (size_t i = 0; i < num_time_steps; ++i) {
-    VALID_CHECK_EQ(probs_seq[i].size(),
-                   vocabulary.size() + 1,
-                   "The shape of probs_seq does not match with "
-                   "the shape of the vocabulary");
-  }
+    Scorer *ext_scorer,
+    double alpha,
+    double beta,
+    DecoderStats *stats,
+    const ContextBiasing *context_biasing,
+    const LexiconOverlay *lexicon_overlay,
+    PathTrie *start,
+    std::vector<PathTrie *> &prefixes) {
+  DECODER_STATS_SCOPE(stats);
+  size_t num_time_steps = frames.size();
 
   // assign blank id
   size_t blank_id = vocabulary.size();
 
-  // init prefixes' root
-  PathTrie root;
-  root.score = root.log_prob_b_prev = 0.0;
-  std::vector<PathTrie *> prefixes;
-  prefixes.push_back(&root);
-
-  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
-    auto fst_dict = static_cast<fst::StdVectorFst *>(ext_scorer->dictionary);
-    fst::StdVectorFst *dict_ptr = fst_dict->Copy(true);
-    root.set_dictionary(dict_ptr);
-    auto matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
-    root.set_matcher(matcher);
-  }
+  prefixes.assign(1, start);
+  PrefixBeam beam;
+  std::vector<std::pair<size_t, float>> log_prob_idx;
 
   // prefix search over time
   for (size_t time_step = 0; time_step < num_time_steps; ++time_step) {
-    auto &prob = probs_seq[time_step];
+    double log_prob_blank = frames.get(time_step, log_prob_idx);
+    DECODER_STATS_LAP(prune_seconds);
 
     float min_cutoff = -NUM_FLT_INF;
     bool full_beam = false;
@@ -59,17 +271,24 @@ std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
       size_t num_prefixes = std::min(prefixes.size(), beam_size);
       std::sort(
           prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
-      min_cutoff = prefixes[num_prefixes - 1]->score +
-                   std::log(prob[blank_id]) - std::max(0.0, ext_scorer->beta);
+      min_cutoff =
+          prefixes[num_prefixes - 1]->score + log_prob_blank - std::max(0.0, beta);
       full_beam = (num_prefixes == beam_size);
     }
-
-    std::vector<std::pair<size_t, float>> log_prob_idx =
-        get_pruned_log_probs(prob, cutoff_prob, cutoff_top_n);
-    // loop over chars
+    DECODER_STATS_LAP(select_seconds);
+
+    beam.load(prefixes, beam_size);
+    DECODER_STATS_ADD(frames, 1);
+    DECODER_STATS_ADD(beam_size_sum, beam.size());
+    DECODER_STATS_MAX(beam_size_max, beam.size());
+    beam.update_blank_and_repeat(log_prob_idx, blank_id, full_beam, min_cutoff);
+    // loop over chars, extending prefixes
     for (size_t index = 0; index < log_prob_idx.size(); index++) {
       auto c = log_prob_idx[index].first;
       auto log_prob_c = log_prob_idx[index].second;
+      if (c == blank_id) {
+        continue;
+      }
       // 判断当前token是否是新word的开始，原规整字符串出现完整word
       bool word_end = false;
       if (c < vocabulary.size()) {
@@ -78,44 +297,36 @@ std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
           word_end = true;
         }
       }
-      for (size_t i = 0; i < prefixes.size() && i < beam_size; ++i) {
-        auto prefix = prefixes[i];
-        if (full_beam && log_prob_c + prefix->score < min_cutoff) {
+      for (size_t i = 0; i < beam.size(); ++i) {
+        if (full_beam && log_prob_c + beam.score[i] < min_cutoff) {
           break;
         }
-        
-        // blank
-        if (c == blank_id) {
-          prefix->log_prob_b_cur =
-              log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
-          continue;
-        }
-        // repeated character
-        if (c == prefix->character) {
-          prefix->log_prob_nb_cur = log_sum_exp(
-              prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
-        }
         // get new prefix
         // 在原规整字符串上加当前token，看能否得到新的规整字符串
+        auto prefix = beam.nodes[i];
         auto prefix_new = prefix->get_path_trie(c, word_end);
 
         // 如果能得到新的规则字符串，则初始化这个prefix的各项参数
         if (prefix_new != nullptr) {
           float log_p = -NUM_FLT_INF;
+          // the word timestamps are read back from the token frames
+          if (prefix_new->offset < 0) {
+            prefix_new->offset = time_step;
+          }
 
           // 如果当前token和原规整字符串最后一个token相同，且原规整字符串的ctc串有以blank结尾的路径
           // 则更新新规整字符串 eg. ab_b -> abb
-          if (c == prefix->character &&
-              prefix->log_prob_b_prev > -NUM_FLT_INF) {
-            log_p = log_prob_c + prefix->log_prob_b_prev;
-          } else if (c != prefix->character) {
-            log_p = log_prob_c + prefix->score;
+          if (c == beam.character[i] &&
+              beam.log_prob_b_prev[i] > -NUM_FLT_INF) {
+            log_p = log_prob_c + beam.log_prob_b_prev[i];
+          } else if (c != beam.character[i]) {
+            log_p = log_prob_c + beam.score[i];
           }
 
           // language model scoring
           
           // 原规整字符串出现完整word，则引入n-gram的score
-          if (ext_scorer != nullptr && prefix->character != -1 &&
+          if (ext_scorer != nullptr && beam.nodes[i] != start &&
               (word_end || ext_scorer->is_character_based())) {
             PathTrie *prefix_to_score = nullptr;
             // skip scoring the space
@@ -132,20 +343,37 @@ std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
             std::vector<std::string> ngram;
             ngram = ext_scorer->make_ngram(prefix_to_score);
             
-            score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
+            double lm_log_prob =
+                ext_scorer->get_log_cond_prob(ngram, lexicon_overlay);
+            score = lm_log_prob * alpha;
             log_p += score;
-            log_p += ext_scorer->beta;
+            log_p += beta;
+            prefix_new->lm_log_prob = prefix->lm_log_prob + lm_log_prob;
+            prefix_new->num_words = prefix->num_words + 1;
+          } else {
+            prefix_new->lm_log_prob = prefix->lm_log_prob;
+            prefix_new->num_words = prefix->num_words;
+          }
+
+          // contextual biasing, walked once per node as the path is fixed
+          if (context_biasing != nullptr) {
+            if (prefix_new->bias_state < 0) {
+              context_biasing->advance(*prefix, c, *prefix_new);
+            }
+            log_p += prefix_new->bias_score - prefix->bias_score;
           }
           prefix_new->log_prob_nb_cur =
               log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
         }
       }  // end of loop over prefix
     }    // end of loop over vocabulary
-
+    beam.store();
+    DECODER_STATS_LAP(extend_seconds);
 
     prefixes.clear();
     // update log probs
-    root.iterate_to_vec(prefixes);
+    start->iterate_to_vec(prefixes);
+    DECODER_STATS_LAP(iterate_seconds);
 
     // only preserve top beam_size prefixes
     if (prefixes.size() >= beam_size) {
@@ -157,46 +385,383 @@ std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
         prefixes[i]->remove();
       }
     }
+    DECODER_STATS_LAP(select_seconds);
   }  // end of loop over time
 
   // score the last word of each prefix that doesn't end with space
   if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
     for (size_t i = 0; i < beam_size && i < prefixes.size(); ++i) {
       auto prefix = prefixes[i];
-      if (!prefix->is_empty()) {
+      if (prefix != start) {
         float score = 0.0;
         std::vector<std::string> ngram = ext_scorer->make_ngram(prefix);
-        score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
-        score += ext_scorer->beta;
+        double lm_log_prob =
+            ext_scorer->get_log_cond_prob(ngram, lexicon_overlay);
+        score = lm_log_prob * alpha;
+        score += beta;
         prefix->score += score;
+        prefix->lm_log_prob += lm_log_prob;
+        prefix->num_words += 1;
       }
     }
   }
 
+  // take back the boosts of the phrases left unfinished
+  if (context_biasing != nullptr) {
+    for (size_t i = 0; i < beam_size && i < prefixes.size(); ++i) {
+      float partial = context_biasing->partial_score(*prefixes[i]);
+      prefixes[i]->score -= partial;
+      prefixes[i]->bias_score -= partial;
+    }
+  }
+
   size_t num_prefixes = std::min(prefixes.size(), beam_size);
   std::sort(prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
 
-  // compute aproximate ctc score as the return score, without affecting the
-  // return order of decoding result. To delete when decoder gets stable.
-  for (size_t i = 0; i < beam_size && i < prefixes.size(); ++i) {
-    double approx_ctc = prefixes[i]->score;
-    if (ext_scorer != nullptr) {
-      std::vector<int> output;
-      prefixes[i]->get_path_vec2(output, vocabulary);
-      auto prefix_length = output.size();
-      auto words = ext_scorer->split_labels(output);
-      // remove word insert
-      approx_ctc = approx_ctc - prefix_length * ext_scorer->beta;
-      // remove language model weight:
-      approx_ctc -= (ext_scorer->get_sent_log_prob(words)) * ext_scorer->alpha;
+  // the ctc score is what is left of the score without the LM, word
+  // insertion and biasing terms accumulated during the search
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    prefixes[i]->approx_ctc = prefixes[i]->score -
+                              alpha * prefixes[i]->lm_log_prob -
+                              beta * prefixes[i]->num_words -
+                              prefixes[i]->bias_score;
+  }
+  DECODER_STATS_LAP(result_seconds);
+  return num_prefixes;
+}
+
+// prefix beam search from an empty prefix, with optional outputs besides
+// the results
+template <typename Frames>
+static std::vector<std::pair<double, std::string>> ctc_prefix_beam_search(
+    const Frames &frames,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    Scorer *ext_scorer,
+    double alpha,
+    double beta,
+    DecoderStats *stats,
+    Lattice *lattice,
+    std::vector<HypothesisScore> *hypothesis_scores,
+    const ContextBiasing *context_biasing) {
+  // init prefixes' root
+  PathTrie root;
+  root.score = root.log_prob_b_prev = 0.0;
+  // the words added at runtime stay as they are for the whole search
+  std::shared_ptr<const LexiconOverlay> lexicon_overlay;
+  {
+    DECODER_STATS_SCOPE(stats);
+    if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
+      auto fst_dict = static_cast<fst::StdVectorFst *>(ext_scorer->dictionary);
+      fst::StdVectorFst *dict_ptr = fst_dict->Copy(true);
+      root.set_dictionary(dict_ptr);
+      auto matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
+      root.set_matcher(matcher);
+      lexicon_overlay = ext_scorer->get_lexicon_overlay();
+      root.set_lexicon_overlay(lexicon_overlay.get());
     }
-    prefixes[i]->approx_ctc = approx_ctc;
+    DECODER_STATS_LAP(init_seconds);
   }
 
-  return get_beam_search_result(prefixes, vocabulary, beam_size, wordlist);
+  std::vector<PathTrie *> prefixes;
+  size_t num_prefixes = ctc_prefix_search(frames,
+                                          vocabulary,
+                                          beam_size,
+                                          ext_scorer,
+                                          alpha,
+                                          beta,
+                                          stats,
+                                          context_biasing,
+                                          lexicon_overlay.get(),
+                                          &root,
+                                          prefixes);
+
+  DECODER_STATS_SCOPE(stats);
+  std::vector<std::tuple<std::string, uint32_t, uint32_t>> wordlist;
+  if (hypothesis_scores != nullptr) {
+    fill_hypothesis_scores(prefixes, num_prefixes, *hypothesis_scores);
+  }
+
+  if (lattice != nullptr) {
+    build_lattice(prefixes,
+                  beam_size,
+                  vocabulary,
+                  ext_scorer,
+                  lexicon_overlay.get(),
+                  *lattice);
+  }
+
+  auto results = get_beam_search_result(
+      prefixes, Detokenizer(vocabulary), beam_size, wordlist);
+  DECODER_STATS_LAP(result_seconds);
+  return results;
+}
+
+
+std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
+    const std::vector<std::vector<double>> &probs_seq,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    Scorer *ext_scorer,
+    DecoderStats *stats,
+    Lattice *lattice,
+    std::vector<HypothesisScore> *hypothesis_scores,
+    const ContextBiasing *context_biasing) {
+  // dimension check
+  size_t num_time_steps = probs_seq.size();
+  for (size_t i = 0; i < num_time_steps; ++i) {
+    VALID_CHECK_EQ(probs_seq[i].size(),
+                   vocabulary.size() + 1,
+                   "The shape of probs_seq does not match with "
+                   "the shape of the vocabulary");
+  }
+  DenseFrames frames(probs_seq, vocabulary.size(), cutoff_prob, cutoff_top_n);
+  double alpha = ext_scorer != nullptr ? ext_scorer->alpha : 0.0;
+  double beta = ext_scorer != nullptr ? ext_scorer->beta : 0.0;
+  return ctc_prefix_beam_search(frames,
+                                vocabulary,
+                                beam_size,
+                                ext_scorer,
+                                alpha,
+                                beta,
+                                stats,
+                                lattice,
+                                hypothesis_scores,
+                                context_biasing);
 }
 
 
+std::vector<std::pair<double, std::string>> ctc_beam_search_decoder_sparse(
+    const std::vector<int> &token_ids,
+    const std::vector<float> &log_probs,
+    const std::vector<int> &row_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    Scorer *ext_scorer,
+    DecoderStats *stats,
+    Lattice *lattice,
+    std::vector<HypothesisScore> *hypothesis_scores,
+    const ContextBiasing *context_biasing) {
+  VALID_CHECK_GT(row_offsets.size(), 0, "row_offsets must not be empty");
+  SparseFrames frames(token_ids,
+                      log_probs,
+                      row_offsets,
+                      0,
+                      row_offsets.size() - 1,
+                      vocabulary.size() + 1,
+                      vocabulary.size(),
+                      cutoff_prob,
+                      cutoff_top_n);
+  double alpha = ext_scorer != nullptr ? ext_scorer->alpha : 0.0;
+  double beta = ext_scorer != nullptr ? ext_scorer->beta : 0.0;
+  return ctc_prefix_beam_search(frames,
+                                vocabulary,
+                                beam_size,
+                                ext_scorer,
+                                alpha,
+                                beta,
+                                stats,
+                                lattice,
+                                hypothesis_scores,
+                                context_biasing);
+}
+
+
+
+// the ngram ending at word i of words, padded with START_TOKEN as
+// Scorer::make_ngram pads it at the start of a sentence
+static std::vector<std::string> word_ngram(
+    const std::vector<std::string> &words, size_t i, size_t max_order) {
+  std::vector<std::string> ngram;
+  size_t first = i + 1 >= max_order ? i + 1 - max_order : 0;
+  ngram.insert(ngram.end(), max_order - (i + 1 - first), START_TOKEN);
+  ngram.insert(ngram.end(), words.begin() + first, words.begin() + i + 1);
+  return ngram;
+}
+
+std::pair<double, std::string> ctc_hybrid_decoder(
+    const std::vector<std::vector<double>> &probs_seq,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double min_confidence,
+    size_t context_frames,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    Scorer *ext_scorer,
+    DecoderStats *stats) {
+  // dimension check
+  size_t num_time_steps = probs_seq.size();
+  for (size_t i = 0; i < num_time_steps; ++i) {
+    VALID_CHECK_EQ(probs_seq[i].size(),
+                   vocabulary.size() + 1,
+                   "The shape of probs_seq does not match with "
+                   "the shape of the vocabulary");
+  }
+  size_t blank_id = vocabulary.size();
+  double alpha = ext_scorer != nullptr ? ext_scorer->alpha : 0.0;
+  double beta = ext_scorer != nullptr ? ext_scorer->beta : 0.0;
+  Detokenizer detokenizer(vocabulary);
+
+  // greedy pass, keeping the best token and its prob of every frame
+  std::vector<size_t> best_ids(num_time_steps);
+  std::vector<double> best_probs(num_time_steps);
+  for (size_t t = 0; t < num_time_steps; ++t) {
+    auto best = std::max_element(probs_seq[t].begin(), probs_seq[t].end());
+    best_ids[t] = best - probs_seq[t].begin();
+    best_probs[t] = *best;
+  }
+
+  // the search may start or stop at frame t if the greedy path has a blank
+  // at t - 1 and its first token from t on starts a word, so that the
+  // segments meet between words
+  std::vector<bool> can_cut(num_time_steps + 1, true);
+  bool next_starts_word = true;
+  for (size_t t = num_time_steps; t-- > 0;) {
+    if (best_ids[t] != blank_id) {
+      next_starts_word = detokenizer.starts_word(best_ids[t]);
+    }
+    can_cut[t] = t == 0 || (best_ids[t - 1] == blank_id && next_starts_word);
+  }
+
+  // windows of uncertain frames, widened by context_frames and out to the
+  // nearest cuts, overlapping windows merged
+  std::vector<std::pair<size_t, size_t>> windows;
+  for (size_t t = 0; t < num_time_steps; ++t) {
+    if (best_probs[t] >= min_confidence) {
+      continue;
+    }
+    size_t end = t + 1;
+    while (end < num_time_steps && best_probs[end] < min_confidence) {
+      ++end;
+    }
+    size_t begin = t > context_frames ? t - context_frames : 0;
+    end = std::min(end + context_frames, num_time_steps);
+    while (!can_cut[begin]) {
+      --begin;
+    }
+    while (!can_cut[end]) {
+      ++end;
+    }
+    if (!windows.empty() && begin <= windows.back().second) {
+      windows.back().second = std::max(windows.back().second, end);
+    } else {
+      windows.emplace_back(begin, end);
+    }
+    t = end - 1;
+  }
+
+  // the dictionary is shared by the searches of all windows
+  std::unique_ptr<fst::StdVectorFst> dict_ptr;
+  std::shared_ptr<FSTMATCH> matcher;
+  std::shared_ptr<const LexiconOverlay> lexicon_overlay;
+  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
+    auto fst_dict = static_cast<fst::StdVectorFst *>(ext_scorer->dictionary);
+    dict_ptr.reset(fst_dict->Copy(true));
+    matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
+    lexicon_overlay = ext_scorer->get_lexicon_overlay();
+  }
+
+  std::vector<int> tokens;
+  std::vector<size_t> word_starts;
+  std::vector<std::string> words;
+  size_t num_scored_words = 0;
+  double score = 0.0;
+  auto append_token = [&](int c) {
+    if (detokenizer.starts_word(c) || words.empty()) {
+      word_starts.push_back(tokens.size());
+      words.emplace_back();
+    }
+    tokens.push_back(c);
+    detokenizer.append_token(c, words.back());
+  };
+  // LM score the greedy words completed so far
+  auto score_words = [&](size_t num_words) {
+    if (ext_scorer == nullptr) {
+      return;
+    }
+    for (; num_scored_words < num_words; ++num_scored_words) {
+      score += alpha * ext_scorer->get_log_cond_prob(
+                           word_ngram(words,
+                                      num_scored_words,
+                                      ext_scorer->get_max_order()),
+                           lexicon_overlay.get()) +
+               beta;
+    }
+  };
+
+  DenseFrames frames(probs_seq, blank_id, cutoff_prob, cutoff_top_n);
+  std::vector<PathTrie *> prefixes;
+  size_t t = 0;
+  for (size_t w = 0; w <= windows.size(); ++w) {
+    // the confident frames up to the next window keep the greedy path
+    size_t begin = w < windows.size() ? windows[w].first : num_time_steps;
+    size_t prev_id = blank_id;
+    for (; t < begin; ++t) {
+      if (best_ids[t] != blank_id && best_ids[t] != prev_id) {
+        if (detokenizer.starts_word(best_ids[t])) {
+          score_words(words.size());
+        }
+        append_token(best_ids[t]);
+      }
+      prev_id = best_ids[t];
+      score += std::log(best_probs[t]);
+    }
+    if (w == windows.size()) {
+      break;
+    }
+    score_words(words.size());
+
+    // beam search the window from the last words as LM context
+    PathTrie root;
+    PathTrie *start = &root;
+    if (ext_scorer != nullptr) {
+      size_t order = ext_scorer->get_max_order();
+      size_t first = words.size() >= order ? words.size() - order + 1 : 0;
+      for (size_t i = first < words.size() ? word_starts[first] : tokens.size();
+           i < tokens.size();
+           ++i) {
+        start = start->get_path_trie(tokens[i]);
+      }
+    }
+    if (dict_ptr != nullptr) {
+      start->set_dictionary(dict_ptr.get());
+      start->set_matcher(matcher);
+      start->set_lexicon_overlay(lexicon_overlay.get());
+    }
+    start->score = start->log_prob_b_prev = 0.0;
+    size_t end = windows[w].second;
+    FrameWindow<DenseFrames> window(frames, t, end - t);
+    ctc_prefix_search(window,
+                      vocabulary,
+                      beam_size,
+                      ext_scorer,
+                      alpha,
+                      beta,
+                      stats,
+                      nullptr,
+                      lexicon_overlay.get(),
+                      start,
+                      prefixes);
+
+    std::vector<int> best_tokens;
+    for (PathTrie *node = prefixes[0]; node != start; node = node->parent) {
+      best_tokens.push_back(node->character);
+    }
+    for (auto c = best_tokens.rbegin(); c != best_tokens.rend(); ++c) {
+      append_token(*c);
+    }
+    num_scored_words = words.size();
+    score += prefixes[0]->score;
+    t = end;
+  }
+  score_words(words.size());
+
+  return std::make_pair(score, detokenizer.detokenize(tokens));
+}
 
 /*
 class BeamDecoder {
@@ -242,8 +807,11 @@ BeamDecoder::BeamDecoder(const std::vector<std::string> &vocabulary,
   this->cutoff_prob = cutoff_prob;
   this->cutoff_top_n = cutoff_top_n;
   this->ext_scorer = ext_scorer;
+  this->context_biasing = nullptr;
+  this->compute_confidences = false;
 
   this->vocabulary = vocabulary;
+  this->detokenizer = Detokenizer(vocabulary);
   this->root = nullptr;
 
   // assign blank id
@@ -263,6 +831,7 @@ BeamDecoder::BeamDecoder(const std::vector<std::string> &vocabulary,
 
 BeamDecoder::~BeamDecoder()
 {
+  DECODER_STATS_SCOPE(&stats);
   if (root != nullptr) {
     delete root;
   }
@@ -271,6 +840,7 @@ BeamDecoder::~BeamDecoder()
 
 void BeamDecoder::reset(bool keep_offset /*default = false*/, bool keep_words /*default = false*/)
 {
+  DECODER_STATS_SCOPE(&stats);
   // init prefixes' root
   if (root != nullptr) {
     delete root;
@@ -287,7 +857,10 @@ void BeamDecoder::reset(bool keep_offset /*default = false*/, bool keep_words /*
     root->set_dictionary(dict_ptr);
     auto matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
     root->set_matcher(matcher);
+    lexicon_overlay = ext_scorer->get_lexicon_overlay();
+    root->set_lexicon_overlay(lexicon_overlay.get());
   }
+  DECODER_STATS_LAP(init_seconds);
 
   if (keep_offset) {
     prev_time_offset += last_decoded_timestep + time_offset;
@@ -299,30 +872,35 @@ void BeamDecoder::reset(bool keep_offset /*default = false*/, bool keep_words /*
     prev_wordlist.insert(
         std::end(prev_wordlist), std::begin(wordlist),
         std::end(wordlist));
+    prev_word_confidences.insert(std::end(prev_word_confidences),
+                                 std::begin(word_confidences),
+                                 std::end(word_confidences));
   } else {
     prev_wordlist.clear();
+    prev_word_confidences.clear();
   }
 
   wordlist.clear();
+  word_confidences.clear();
   time_offset = 0;
   last_decoded_timestep = 0;
 }
 
 
-std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vector<std::vector<double>> &probs_seq)
+template <typename Frames>
+std::vector<std::pair<double, std::string>> BeamDecoder::decode_frames(
+    const Frames &frames, BeamResults *token_results)
 {
-  // dimension check
-  size_t num_time_steps = probs_seq.size();
-  for (size_t i = 0; i < num_time_steps; ++i) {
-    VALID_CHECK_EQ(probs_seq[i].size(),
-                   vocabulary.size(),
-                   "The shape of probs_seq does not match with "
-                   "the shape of the vocabulary");
-  }
+  DECODER_STATS_SCOPE(&stats);
+  size_t num_time_steps = frames.size();
+
+  PrefixBeam beam;
+  std::vector<std::pair<size_t, float>> log_prob_idx;
 
   // prefix search over time
   for (size_t time_step = 0; time_step < num_time_steps; ++time_step) {
-    auto &prob = probs_seq[time_step];
+    double log_prob_blank = frames.get(time_step, log_prob_idx);
+    DECODER_STATS_LAP(prune_seconds);
 
     float min_cutoff = -NUM_FLT_INF;
     bool full_beam = false;
@@ -332,46 +910,44 @@ std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vecto
       size_t num_prefixes = std::min(prefixes.size(), beam_size);
       std::sort(
           prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
-      min_cutoff = prefixes[num_prefixes - 1]->score +
-                   std::log(prob[blank_id]) - std::max(0.0, ext_scorer->beta);
+      min_cutoff = prefixes[num_prefixes - 1]->score + log_prob_blank -
+                   std::max(0.0, ext_scorer->beta);
       full_beam = (num_prefixes == beam_size);
     }
-
-    std::vector<std::pair<size_t, float>> log_prob_idx =
-        get_pruned_log_probs(prob, cutoff_prob, cutoff_top_n);
-    // loop over chars
+    DECODER_STATS_LAP(select_seconds);
+
+    beam.load(prefixes, beam_size);
+    DECODER_STATS_ADD(frames, 1);
+    DECODER_STATS_ADD(beam_size_sum, beam.size());
+    DECODER_STATS_MAX(beam_size_max, beam.size());
+    beam.update_blank_and_repeat(log_prob_idx, blank_id, full_beam, min_cutoff);
+    // loop over chars, extending prefixes
     for (size_t index = 0; index < log_prob_idx.size(); index++) {
       auto c = log_prob_idx[index].first;
       auto log_prob_c = log_prob_idx[index].second;
+      if (c == blank_id) {
+        continue;
+      }
 
-      for (size_t i = 0; i < prefixes.size() && i < beam_size; ++i) {
-        auto prefix = prefixes[i];
-        if (full_beam && log_prob_c + prefix->score < min_cutoff) {
+      for (size_t i = 0; i < beam.size(); ++i) {
+        if (full_beam && log_prob_c + beam.score[i] < min_cutoff) {
           break;
         }
-        // blank
-        if (c == blank_id) {
-          prefix->log_prob_b_cur =
-              log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
-          continue;
-        }
-        // repeated character
-        if (c == prefix->character) {
-          prefix->log_prob_nb_cur = log_sum_exp(
-              prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
-        }
         // get new prefix
+        auto prefix = beam.nodes[i];
         auto prefix_new = prefix->get_path_trie(c);
 
         if (prefix_new != nullptr) {
           float log_p = -NUM_FLT_INF;
-          prefix_new->offset = prev_time_offset + time_offset + time_step;
+          if (prefix_new->offset < 0) {
+            prefix_new->offset = prev_time_offset + time_offset + time_step;
+          }
 
-          if (c == prefix->character &&
-              prefix->log_prob_b_prev > -NUM_FLT_INF) {
-            log_p = log_prob_c + prefix->log_prob_b_prev;
-          } else if (c != prefix->character) {
-            log_p = log_prob_c + prefix->score;
+          if (c == beam.character[i] &&
+              beam.log_prob_b_prev[i] > -NUM_FLT_INF) {
+            log_p = log_prob_c + beam.log_prob_b_prev[i];
+          } else if (c != beam.character[i]) {
+            log_p = log_prob_c + beam.score[i];
           }
 
           // language model scoring
@@ -388,19 +964,37 @@ std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vecto
             float score = 0.0;
             std::vector<std::string> ngram;
             ngram = ext_scorer->make_ngram(prefix_to_score);
-            score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
+            double lm_log_prob =
+                ext_scorer->get_log_cond_prob(ngram, lexicon_overlay.get());
+            score = lm_log_prob * ext_scorer->alpha;
             log_p += score;
             log_p += ext_scorer->beta;
+            prefix_new->lm_log_prob = prefix->lm_log_prob + lm_log_prob;
+            prefix_new->num_words = prefix->num_words + 1;
+          } else {
+            prefix_new->lm_log_prob = prefix->lm_log_prob;
+            prefix_new->num_words = prefix->num_words;
+          }
+
+          // contextual biasing, walked once per node as the path is fixed
+          if (context_biasing != nullptr) {
+            if (prefix_new->bias_state < 0) {
+              context_biasing->advance(*prefix, c, *prefix_new);
+            }
+            log_p += prefix_new->bias_score - prefix->bias_score;
           }
           prefix_new->log_prob_nb_cur =
               log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
         }
       }  // end of loop over prefix
     }    // end of loop over vocabulary
+    beam.store();
+    DECODER_STATS_LAP(extend_seconds);
 
     prefixes.clear();
     // update log probs
     root->iterate_to_vec(prefixes);
+    DECODER_STATS_LAP(iterate_seconds);
 
     // only preserve top beam_size prefixes
     if (prefixes.size() >= beam_size) {
@@ -412,6 +1006,7 @@ std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vecto
         prefixes[i]->remove();
       }
     }
+    DECODER_STATS_LAP(select_seconds);
   }  // end of loop over time
 
   // TODO: remove sorting here
@@ -419,7 +1014,84 @@ std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vecto
   std::sort(prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
   last_decoded_timestep = num_time_steps;
 
-  return get_beam_search_result(prefixes, vocabulary, beam_size, wordlist);
+  double alpha = ext_scorer != nullptr ? ext_scorer->alpha : 0.0;
+  double beta = ext_scorer != nullptr ? ext_scorer->beta : 0.0;
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    prefixes[i]->approx_ctc = prefixes[i]->score -
+                              alpha * prefixes[i]->lm_log_prob -
+                              beta * prefixes[i]->num_words -
+                              prefixes[i]->bias_score;
+  }
+  fill_hypothesis_scores(prefixes, num_prefixes, hypothesis_scores);
+
+  if (token_results != nullptr) {
+    fill_beam_results(prefixes, num_prefixes, *token_results);
+    prefixes[0]->get_words(detokenizer, wordlist);
+    word_confidences.assign(wordlist.size(), -1.0);
+    DECODER_STATS_LAP(result_seconds);
+    return {};
+  }
+
+  auto results = get_beam_search_result(
+      prefixes,
+      detokenizer,
+      beam_size,
+      wordlist,
+      compute_confidences ? &word_confidences : nullptr);
+  if (!compute_confidences) {
+    word_confidences.assign(wordlist.size(), -1.0);
+  }
+  DECODER_STATS_LAP(result_seconds);
+  return results;
+}
+
+std::vector<std::pair<double, std::string>> BeamDecoder::decode(const std::vector<std::vector<double>> &probs_seq)
+{
+  // dimension check
+  size_t num_time_steps = probs_seq.size();
+  for (size_t i = 0; i < num_time_steps; ++i) {
+    VALID_CHECK_EQ(probs_seq[i].size(),
+                   vocabulary.size(),
+                   "The shape of probs_seq does not match with "
+                   "the shape of the vocabulary");
+  }
+  DenseFrames frames(probs_seq, blank_id, cutoff_prob, cutoff_top_n);
+  return decode_frames(frames);
+}
+
+BeamResults BeamDecoder::decode_tokens(
+    const std::vector<std::vector<double>> &probs_seq)
+{
+  // dimension check
+  size_t num_time_steps = probs_seq.size();
+  for (size_t i = 0; i < num_time_steps; ++i) {
+    VALID_CHECK_EQ(probs_seq[i].size(),
+                   vocabulary.size(),
+                   "The shape of probs_seq does not match with "
+                   "the shape of the vocabulary");
+  }
+  DenseFrames frames(probs_seq, blank_id, cutoff_prob, cutoff_top_n);
+  BeamResults results;
+  decode_frames(frames, &results);
+  return results;
+}
+
+std::vector<std::pair<double, std::string>> BeamDecoder::decode_sparse(
+    const std::vector<int> &token_ids,
+    const std::vector<float> &log_probs,
+    const std::vector<int> &row_offsets)
+{
+  VALID_CHECK_GT(row_offsets.size(), 0, "row_offsets must not be empty");
+  SparseFrames frames(token_ids,
+                      log_probs,
+                      row_offsets,
+                      0,
+                      row_offsets.size() - 1,
+                      vocabulary.size(),
+                      blank_id,
+                      cutoff_prob,
+                      cutoff_top_n);
+  return decode_frames(frames);
 }
 
 void BeamDecoder::get_word_timestamps(
@@ -432,6 +1104,17 @@ void BeamDecoder::get_word_timestamps(
       std::end(words), std::begin(wordlist), std::end(wordlist));
 }
 
+void BeamDecoder::get_word_confidences(std::vector<float>& confidences)
+{
+  confidences.clear();
+  confidences.insert(std::end(confidences),
+                     std::begin(prev_word_confidences),
+                     std::end(prev_word_confidences));
+  confidences.insert(std::end(confidences),
+                     std::begin(word_confidences),
+                     std::end(word_confidences));
+}
+
 
 std::vector<std::vector<std::pair<double, std::string>>>
 ctc_beam_search_decoder_batch(
@@ -441,13 +1124,18 @@ ctc_beam_search_decoder_batch(
     size_t num_processes,
     double cutoff_prob,
     size_t cutoff_top_n,
-    Scorer *ext_scorer) {
+    Scorer *ext_scorer,
+    DecoderStats *stats,
+    const ContextBiasing *context_biasing) {
   VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
   // thread pool
   ThreadPool pool(num_processes);
   // number of samples
   size_t batch_size = probs_split.size();
 
+  // one stats instance per sample, merged once all are decoded
+  std::vector<DecoderStats> batch_stats(stats != nullptr ? batch_size : 0);
+
   // enqueue the tasks of decoding
   std::vector<std::future<std::vector<std::pair<double, std::string>>>> res;
   for (size_t i = 0; i < batch_size; ++i) {
@@ -457,7 +1145,82 @@ ctc_beam_search_decoder_batch(
                                   beam_size,
                                   cutoff_prob,
                                   cutoff_top_n,
-                                  ext_scorer));
+                                  ext_scorer,
+                                  stats != nullptr ? &batch_stats[i] : nullptr,
+                                  nullptr,
+                                  nullptr,
+                                  context_biasing));
+  }
+
+  // get decoding results
+  std::vector<std::vector<std::pair<double, std::string>>> batch_results;
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch_results.emplace_back(res[i].get());
+  }
+  for (const auto &sample_stats : batch_stats) {
+    stats->merge(sample_stats);
+  }
+  return batch_results;
+}
+
+
+std::vector<std::vector<std::pair<double, std::string>>>
+ctc_beam_search_decoder_sparse_batch(
+    const std::vector<int> &token_ids,
+    const std::vector<float> &log_probs,
+    const std::vector<int> &row_offsets,
+    const std::vector<int> &utterance_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    Scorer *ext_scorer,
+    DecoderStats *stats,
+    const ContextBiasing *context_biasing) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  VALID_CHECK_GT(utterance_offsets.size(), 0,
+                 "utterance_offsets must not be empty");
+  // number of samples
+  size_t batch_size = utterance_offsets.size() - 1;
+  // validate every sample before any thread starts
+  std::vector<SparseFrames> frames;
+  for (size_t i = 0; i < batch_size; ++i) {
+    VALID_CHECK(utterance_offsets[i] >= 0 &&
+                    utterance_offsets[i] <= utterance_offsets[i + 1],
+                "utterance_offsets must be nondecreasing");
+    frames.emplace_back(token_ids,
+                        log_probs,
+                        row_offsets,
+                        utterance_offsets[i],
+                        utterance_offsets[i + 1],
+                        vocabulary.size() + 1,
+                        vocabulary.size(),
+                        cutoff_prob,
+                        cutoff_top_n);
+  }
+  double alpha = ext_scorer != nullptr ? ext_scorer->alpha : 0.0;
+  double beta = ext_scorer != nullptr ? ext_scorer->beta : 0.0;
+  // thread pool
+  ThreadPool pool(num_processes);
+  std::vector<DecoderStats> batch_stats(stats != nullptr ? batch_size : 0);
+
+  // enqueue the tasks of decoding
+  std::vector<std::future<std::vector<std::pair<double, std::string>>>> res;
+  for (size_t i = 0; i < batch_size; ++i) {
+    DecoderStats *sample_stats = stats != nullptr ? &batch_stats[i] : nullptr;
+    res.emplace_back(pool.enqueue([&, i, sample_stats]() {
+      return ctc_prefix_beam_search(frames[i],
+                                    vocabulary,
+                                    beam_size,
+                                    ext_scorer,
+                                    alpha,
+                                    beta,
+                                    sample_stats,
+                                    nullptr,
+                                    nullptr,
+                                    context_biasing);
+    }));
   }
 
   // get decoding results
@@ -465,7 +1228,150 @@ ctc_beam_search_decoder_batch(
   for (size_t i = 0; i < batch_size; ++i) {
     batch_results.emplace_back(res[i].get());
   }
+  for (const auto &sample_stats : batch_stats) {
+    stats->merge(sample_stats);
+  }
   return batch_results;
 }
 
 
+std::vector<std::vector<std::pair<double, std::string>>>
+ctc_beam_search_decoder_file(
+    const std::string &posterior_path,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    Scorer *ext_scorer,
+    DecoderStats *stats) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  PosteriorFile posteriors(posterior_path);
+  VALID_CHECK_EQ(posteriors.num_classes(),
+                 vocabulary.size() + 1,
+                 "The shape of the posteriors does not match with "
+                 "the shape of the vocabulary");
+  // thread pool
+  ThreadPool pool(num_processes);
+  // number of samples
+  size_t batch_size = posteriors.num_utterances();
+  std::vector<DecoderStats> batch_stats(stats != nullptr ? batch_size : 0);
+
+  // enqueue the tasks of decoding, each reading its own utterance
+  std::vector<std::future<std::vector<std::pair<double, std::string>>>> res;
+  for (size_t i = 0; i < batch_size; ++i) {
+    DecoderStats *sample_stats = stats != nullptr ? &batch_stats[i] : nullptr;
+    res.emplace_back(pool.enqueue([&, i, sample_stats]() {
+      if (!posteriors.is_sparse()) {
+        return ctc_beam_search_decoder(posteriors.get_probs(i),
+                                       vocabulary,
+                                       beam_size,
+                                       cutoff_prob,
+                                       cutoff_top_n,
+                                       ext_scorer,
+                                       sample_stats);
+      }
+      // top-k files go to the sparse search without densifying
+      std::vector<int> token_ids;
+      std::vector<float> log_probs;
+      std::vector<int> row_offsets;
+      posteriors.get_sparse_log_probs(i, token_ids, log_probs, row_offsets);
+      return ctc_beam_search_decoder_sparse(token_ids,
+                                            log_probs,
+                                            row_offsets,
+                                            vocabulary,
+                                            beam_size,
+                                            cutoff_prob,
+                                            cutoff_top_n,
+                                            ext_scorer,
+                                            sample_stats);
+    }));
+  }
+
+  // get decoding results
+  std::vector<std::vector<std::pair<double, std::string>>> batch_results;
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch_results.emplace_back(res[i].get());
+  }
+  for (const auto &sample_stats : batch_stats) {
+    stats->merge(sample_stats);
+  }
+  return batch_results;
+}
+
+
+std::vector<double> ctc_beam_search_grid_search(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    const std::vector<std::string> &references,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    const std::vector<double> &alphas,
+    const std::vector<double> &betas,
+    Scorer *ext_scorer,
+    double cutoff_prob,
+    size_t cutoff_top_n) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  VALID_CHECK(ext_scorer != nullptr, "Grid search needs an external scorer");
+  VALID_CHECK_EQ(probs_split.size(),
+                 references.size(),
+                 "Every sample needs one reference");
+  size_t batch_size = probs_split.size();
+  for (size_t i = 0; i < batch_size; ++i) {
+    for (size_t t = 0; t < probs_split[i].size(); ++t) {
+      VALID_CHECK_EQ(probs_split[i][t].size(),
+                     vocabulary.size() + 1,
+                     "The shape of probs_seq does not match with "
+                     "the shape of the vocabulary");
+    }
+  }
+  // thread pool
+  ThreadPool pool(num_processes);
+
+  // prune and log every frame once, shared by all grid points
+  std::vector<std::future<CachedFrames>> cache_res;
+  for (size_t i = 0; i < batch_size; ++i) {
+    cache_res.emplace_back(pool.enqueue([&, i]() {
+      return CachedFrames(
+          probs_split[i], vocabulary.size(), cutoff_prob, cutoff_top_n);
+    }));
+  }
+  std::vector<CachedFrames> frames;
+  for (size_t i = 0; i < batch_size; ++i) {
+    frames.emplace_back(cache_res[i].get());
+  }
+
+  // one task per grid point and sample, the scorer being only read
+  size_t num_points = alphas.size() * betas.size();
+  std::vector<std::future<ErrorCounts>> res;
+  for (size_t p = 0; p < num_points; ++p) {
+    double alpha = alphas[p / betas.size()];
+    double beta = betas[p % betas.size()];
+    for (size_t i = 0; i < batch_size; ++i) {
+      res.emplace_back(pool.enqueue([&, i, alpha, beta]() {
+        auto results = ctc_prefix_beam_search(frames[i],
+                                              vocabulary,
+                                              beam_size,
+                                              ext_scorer,
+                                              alpha,
+                                              beta,
+                                              nullptr,
+                                              nullptr,
+                                              nullptr,
+                                              nullptr);
+        std::string best = results.empty() ? "" : results[0].second;
+        return error_counts(best, references[i]);
+      }));
+    }
+  }
+
+  std::vector<double> wers(num_points);
+  for (size_t p = 0; p < num_points; ++p) {
+    ErrorCounts total;
+    for (size_t i = 0; i < batch_size; ++i) {
+      total.add(res[p * batch_size + i].get());
+    }
+    wers[p] = total.error_rate();
+  }
+  return wers;
+}
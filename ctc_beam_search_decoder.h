@@ -1,12 +1,53 @@
 #ifndef CTC_BEAM_SEARCH_DECODER_H_
 #define CTC_BEAM_SEARCH_DECODER_H_
 
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "context_biasing.h"
+#include "decoder_stats.h"
+#include "detokenizer.h"
+#include "lattice.h"
 #include "scorer.h"
 
+/* Parts of a hypothesis score, such that
+ *     score = acoustic + alpha * lm + beta * num_words + bias
+ * acoustic being the CTC log prob of the hypothesis, lm the sum of the
+ * LM log probs of its num_words scored words and bias the contextual
+ * biasing boost, zero without a ContextBiasing.
+ */
+struct HypothesisScore {
+  double acoustic;
+  double lm;
+  int num_words;
+  double bias;
+};
+
+/* Results of a beam search in flat arrays, without building their text.
+ * Hypothesis i, best first, has score scores[i] and the token ids
+ * tokens[offsets[i]] to tokens[offsets[i + 1] - 1], the token at j being
+ * emitted at frame frames[j].
+ */
+struct BeamResults {
+  std::vector<double> scores;
+  std::vector<int> tokens;
+  std::vector<uint32_t> frames;
+  std::vector<int> offsets;
+
+  size_t size() const { return scores.size(); }
+
+  // token ids of hypothesis i
+  std::vector<int> get_tokens(size_t i) const;
+
+  // text of hypothesis i, built on demand; pass a Detokenizer kept for
+  // the vocabulary to skip building one for every call
+  std::string get_text(size_t i,
+                       const std::vector<std::string> &vocabulary) const;
+  std::string get_text(size_t i, const Detokenizer &detokenizer) const;
+};
+
 /* CTC Beam Search Decoder
 
  * Parameters:
@@ -19,6 +60,14 @@
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     stats: Optional counters and stage timings, accumulated when built
+ *            with -DDECODER_STATS.
+ *     lattice: Optional output, filled with the word lattice of the
+ *              returned hypotheses, see Lattice.
+ *     hypothesis_scores: Optional output, filled with the score parts of
+ *                        each returned hypothesis, tracked during the
+ *                        search.
+ *     context_biasing: Optional phrases to boost, see ContextBiasing.
  * Return:
  *     A vector that each element is a pair of score  and decoding result,
  *     in desending order.
@@ -29,7 +78,70 @@ std::vector<std::pair<double, std::string>> ctc_beam_search_decoder(
     size_t beam_size,
     double cutoff_prob = 1.0,
     size_t cutoff_top_n = 40,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr,
+    Lattice *lattice = nullptr,
+    std::vector<HypothesisScore> *hypothesis_scores = nullptr,
+    const ContextBiasing *context_biasing = nullptr);
+
+/* CTC Beam Search Decoder over sparse top-k frames
+
+ * Parameters:
+ *     token_ids, log_probs, row_offsets: Frames in CSR form, frame t holds
+ *               the log probabilities log_probs[i] of tokens token_ids[i]
+ *               for i in [row_offsets[t], row_offsets[t + 1]). The blank,
+ *               id vocabulary.size(), must be present in every frame.
+ *     cutoff_prob: Cutoff probability for pruning, frames are used as given
+ *                  when 1.0.
+ *     Other parameters are the same as ctc_beam_search_decoder().
+ * Return:
+ *     The same as ctc_beam_search_decoder().
+*/
+std::vector<std::pair<double, std::string>> ctc_beam_search_decoder_sparse(
+    const std::vector<int> &token_ids,
+    const std::vector<float> &log_probs,
+    const std::vector<int> &row_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr,
+    Lattice *lattice = nullptr,
+    std::vector<HypothesisScore> *hypothesis_scores = nullptr,
+    const ContextBiasing *context_biasing = nullptr);
+
+
+/* CTC Decoder searching only the uncertain frames
+
+ * The greedy path is kept wherever the best token of a frame has at least
+ * min_confidence probability. Every run of frames below it is widened by
+ * context_frames on both sides and out to where the greedy path is between
+ * words, then beam searched with the last words decoded before it as LM
+ * context. The greedy words are LM scored like those of the beam.
+ *
+ * Parameters:
+ *     min_confidence: Probability of the best token under which a frame is
+ *                     beam searched. Above 1.0 all frames are, decoding
+ *                     like ctc_beam_search_decoder(), at 0.0 none.
+ *     context_frames: Frames beam searched on each side of an uncertain
+ *                     run.
+ *     Other parameters are the same as ctc_beam_search_decoder().
+ * Return:
+ *     The score and decoding result. The score of the greedy frames is
+ *     their best path's, so it only approximates the prefix score of
+ *     ctc_beam_search_decoder().
+*/
+std::pair<double, std::string> ctc_hybrid_decoder(
+    const std::vector<std::vector<double>> &probs_seq,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double min_confidence = 0.9,
+    size_t context_frames = 5,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr);
 
 
 class BeamDecoder {
@@ -44,23 +156,67 @@ public:
   // decode a frame
   std::vector<std::pair<double, std::string>> decode(const std::vector<std::vector<double>> &probs_seq);
 
+  // decode sparse top-k frames in the CSR form of
+  // ctc_beam_search_decoder_sparse(), the blank being the last token
+  std::vector<std::pair<double, std::string>> decode_sparse(
+      const std::vector<int> &token_ids,
+      const std::vector<float> &log_probs,
+      const std::vector<int> &row_offsets);
+
+  // decode like decode(), returning the token ids of the hypotheses
+  // instead of their text; only the best one's words are built, for
+  // get_word_timestamps(), their confidences being left at -1
+  BeamResults decode_tokens(const std::vector<std::vector<double>> &probs_seq);
+
   void get_word_timestamps(
       std::vector<std::tuple<std::string, uint32_t, uint32_t>>& words);
 
+  // confidence of each word of get_word_timestamps(), the share of the
+  // beam's posterior mass whose hypotheses have the word at overlapping
+  // frames; -1 unless enabled by set_word_confidences()
+  void get_word_confidences(std::vector<float>& confidences);
+
+  // compute word confidences from the next decode on, which walks the words
+  // of every hypothesis rather than the best one's only; off by default
+  void set_word_confidences(bool enabled) { compute_confidences = enabled; }
+
   void add_start_offset(int offset) { time_offset += offset; }
   void set_start_offset(int offset) { time_offset = offset; }
 
+  // boost the phrases of biasing, nullptr to stop; takes effect from the
+  // next reset(), the prefixes in the beam not knowing the new phrases
+  void set_context_biasing(const ContextBiasing *biasing) {
+    context_biasing = biasing;
+  }
+
+  // score parts of the hypotheses returned by the last decode
+  std::vector<HypothesisScore> get_hypothesis_scores() const {
+    return hypothesis_scores;
+  }
+
   // reset state
   void reset(bool keep_offset = false, bool keep_words = false);
 
+  // counters and stage timings accumulated since construction or the last
+  // reset_stats(), zero unless built with -DDECODER_STATS
+  DecoderStats get_stats() const { return stats; }
+  void reset_stats() { stats.reset(); }
+
 private:
+  template <typename Frames>
+  std::vector<std::pair<double, std::string>> decode_frames(
+      const Frames &frames, BeamResults *token_results = nullptr);
+
   Scorer *ext_scorer;
   size_t beam_size;
   double cutoff_prob;
   size_t cutoff_top_n;
+  const ContextBiasing *context_biasing;
+  bool compute_confidences;
 
   // state
   std::vector<std::string> vocabulary;
+  Detokenizer detokenizer;
   size_t blank_id;
   int space_id;
   // for word timestamps
@@ -70,9 +226,16 @@ private:
   int last_decoded_timestep; // timestep of the last parsed prefix
   std::vector<std::tuple<std::string, uint32_t, uint32_t>> prev_wordlist;
   std::vector<std::tuple<std::string, uint32_t, uint32_t>> wordlist;
+  std::vector<float> prev_word_confidences;
+  std::vector<float> word_confidences;
 
   PathTrie *root;
   std::vector<PathTrie *> prefixes;
+  // words added to the scorer at runtime, as of the last reset
+  std::shared_ptr<const LexiconOverlay> lexicon_overlay;
+  std::vector<HypothesisScore> hypothesis_scores;
+
+  DecoderStats stats;
 };
 
 
@@ -90,6 +253,10 @@ private:
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     stats: Optional counters and stage timings merged over all samples,
+ *            accumulated when built with -DDECODER_STATS.
+ *     context_biasing: Optional phrases to boost in every sample, see
+ *                      ContextBiasing.
  * Return:
  *     A 2-D vector that each element is a vector of beam search decoding
  *     result for one audio sample.
@@ -102,7 +269,94 @@ ctc_beam_search_decoder_batch(
     size_t num_processes,
     double cutoff_prob = 1.0,
     size_t cutoff_top_n = 40,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr,
+    const ContextBiasing *context_biasing = nullptr);
+
+
+/* CTC Beam Search Decoder for a batch of sparse top-k frames
+
+ * Parameters:
+ *     token_ids, log_probs, row_offsets: Frames of all samples in the CSR
+ *               form of ctc_beam_search_decoder_sparse().
+ *     utterance_offsets: Sample i spans the frames
+ *                        [utterance_offsets[i], utterance_offsets[i + 1]).
+ *     Other parameters are the same as ctc_beam_search_decoder_batch().
+ * Return:
+ *     The same as ctc_beam_search_decoder_batch().
+*/
+std::vector<std::vector<std::pair<double, std::string>>>
+ctc_beam_search_decoder_sparse_batch(
+    const std::vector<int> &token_ids,
+    const std::vector<float> &log_probs,
+    const std::vector<int> &row_offsets,
+    const std::vector<int> &utterance_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr,
+    const ContextBiasing *context_biasing = nullptr);
+
+
+/* Word error rates of the beam search over a grid of LM weights
+
+ * Parameters:
+ *     probs_split: 3-D vector of the samples' probabilities, as taken by
+ *                  ctc_beam_search_decoder_batch().
+ *     references: Reference transcript of each sample, words separated by
+ *                 spaces.
+ *     vocabulary: A vector of vocabulary.
+ *     beam_size: The width of beam search.
+ *     num_processes: Number of threads, shared by all grid points.
+ *     alphas, betas: The grid is every (alphas[i], betas[j]) pair. They
+ *                    replace ext_scorer's alpha and beta, which are left
+ *                    unchanged.
+ *     ext_scorer: External scorer, required.
+ *     cutoff_prob: Cutoff probability for pruning.
+ *     cutoff_top_n: Cutoff number for pruning.
+ * Return:
+ *     The corpus WER of the best hypotheses at each grid point, point
+ *     (i, j) at index i * betas.size() + j. Frames are pruned once and
+ *     reused by all grid points.
+*/
+std::vector<double> ctc_beam_search_grid_search(
+    const std::vector<std::vector<std::vector<double>>> &probs_split,
+    const std::vector<std::string> &references,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    const std::vector<double> &alphas,
+    const std::vector<double> &betas,
+    Scorer *ext_scorer,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40);
+
+
+/* CTC Beam Search Decoder for all utterances of a posterior file
+
+ * Parameters:
+ *     posterior_path: Path of a file written by posterior_file.py, see
+ *                     PosteriorFile. Each utterance is read from the
+ *                     memory mapped file by the thread decoding it, and
+ *                     top-k files are decoded as sparse frames.
+ *     Other parameters are the same as ctc_beam_search_decoder_batch().
+ * Return:
+ *     A 2-D vector that each element is a vector of beam search decoding
+ *     result for one utterance, in file order.
+*/
+std::vector<std::vector<std::pair<double, std::string>>>
+ctc_beam_search_decoder_file(
+    const std::string &posterior_path,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    Scorer *ext_scorer = nullptr,
+    DecoderStats *stats = nullptr);
 
 #endif  // CTC_BEAM_SEARCH_DECODER_H_
 
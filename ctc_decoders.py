@@ -17,10 +17,127 @@ class Scorer(swig_decoders.Scorer):
     :type beta: float
     :model_path: Path to load language model.
     :type model_path: basestring
+    :param num_processes: Number of threads loading the language model,
+                          the word map and the dictionary.
+    :type num_processes: int
+    :param verbose: Whether to report each loading stage on stderr.
+    :type verbose: bool
+    """
+
+    def __init__(self, alpha, beta, model_path, word_path, vocabulary,
+                 num_processes=1, verbose=False):
+        swig_decoders.Scorer.__init__(self, alpha, beta, model_path, word_path,
+                                      vocabulary, num_processes, verbose)
+
+
+class Rescorer(swig_decoders.Rescorer):
+    """Wrapper for Rescorer, the second pass N-best rescorer.
+
+    :param alpha: Weight of the rescoring language model.
+    :type alpha: float
+    :param beta: Word insertion weight.
+    :type beta: float
+    :param model_path: Path to the rescoring language model.
+    :type model_path: basestring
+    """
+
+    def __init__(self, alpha, beta, model_path):
+        swig_decoders.Rescorer.__init__(self, alpha, beta, model_path)
+
+    def rescore(self, nbest_split, num_processes=1):
+        """Rescore a batch of N-best lists in parallel.
+
+        :param nbest_split: N-best lists of (score, sentence) tuples, e.g.
+                            from ctc_beam_search_decoder_batch(). Pass the
+                            acoustic scores instead of the scores to
+                            replace the first pass LM.
+        :type nbest_split: list
+        :param num_processes: Number of parallel processes.
+        :type num_processes: int
+        :return: The N-best lists with base + alpha * lm + beta * num_words
+                 as score, in descending order of the new score.
+        :rtype: list
+        """
+        nbest_split = [[(float(score), sentence) for score, sentence in nbest]
+                       for nbest in nbest_split]
+        batch_results = swig_decoders.Rescorer.rescore(self, nbest_split,
+                                                       num_processes)
+        return [[(res[0], res[1]) for res in results]
+                for results in batch_results]
+
+
+class DecoderStats(swig_decoders.DecoderStats):
+    """Wrapper for DecoderStats, the counters and per-stage timings of
+    decoding. They are only collected when the decoders are built with
+    `python setup.py install --decoder_stats`, see DecoderStats.enabled().
+    """
+
+    def __init__(self):
+        swig_decoders.DecoderStats.__init__(self)
+
+
+class Lattice(swig_decoders.Lattice):
+    """Wrapper for Lattice, the N-best word lattice of a beam search.
+
+    Arcs hold from_state, to_state, word, acoustic and lm; a path scores
+    acoustic + alpha * lm + beta per arc plus the final_acoustic of its
+    final state. write_fst(path, alpha, beta) saves it as an OpenFst
+    acceptor for rescoring and returns False if the file can't be written.
+    """
+
+    def __init__(self):
+        swig_decoders.Lattice.__init__(self)
+
+
+class Detokenizer(swig_decoders.Detokenizer):
+    """Wrapper for Detokenizer, joining token ids into text like the
+    decoders do, from tables built once for the vocabulary.
+
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    """
+
+    def __init__(self, vocabulary):
+        swig_decoders.Detokenizer.__init__(self, vocabulary)
+
+    def detokenize(self, tokens):
+        return swig_decoders.Detokenizer.detokenize(self, _to_list(tokens))
+
+
+class WordMap(swig_decoders.WordMap):
+    """Wrapper for WordMap, the decoding lexicon a Scorer reads from its
+    word map file, a word and its pieces per line.
     """
 
-    def __init__(self, alpha, beta, model_path, word_path, vocabulary):
-        swig_decoders.Scorer.__init__(self, alpha, beta, model_path, word_path, vocabulary)
+    def get_tokens(self, word):
+        """Token ids spelling word.
+
+        :return: Token ids, empty if word is absent or spelled with a piece
+                 not in the vocabulary.
+        :rtype: list
+        """
+        return list(swig_decoders.WordMap.get_tokens(self, word))
+
+
+class ContextBiasing(swig_decoders.ContextBiasing):
+    """Wrapper for ContextBiasing, phrases boosted during the beam search.
+
+    Every token of a partial match earns the boost of its phrase, which is
+    taken back if the match fails, and kept once the phrase is complete.
+
+    :param phrases: Phrases as lists of token ids, in the vocabulary of
+                    the decoder.
+    :type phrases: list
+    :param boosts: Boost per matched token, one per phrase or a single one
+                   for all.
+    :type boosts: float or list
+    """
+
+    def __init__(self, phrases, boosts):
+        phrases = [_to_list(phrase) for phrase in phrases]
+        if not isinstance(boosts, (int, float)):
+            boosts = [float(boost) for boost in boosts]
+        swig_decoders.ContextBiasing.__init__(self, phrases, boosts)
 
 
 class BeamDecoder(swig_decoders.BeamDecoder):
@@ -43,6 +160,54 @@ class BeamDecoder(swig_decoders.BeamDecoder):
         beam_results = [(res[0], res[1]) for res in beam_results]
         return beam_results
 
+    def decode_sparse(self, token_ids, log_probs, row_offsets):
+        """Decode sparse top-k frames, see ctc_beam_search_decoder_sparse.
+        """
+        beam_results = swig_decoders.BeamDecoder.decode_sparse(
+            self, _to_list(token_ids), _to_list(log_probs),
+            _to_list(row_offsets))
+        beam_results = [(res[0], res[1]) for res in beam_results]
+        return beam_results
+
+    def decode_tokens(self, probs_seq):
+        """Decode like decode, leaving the text of the hypotheses to be
+        built on demand.
+
+        :return: Hypotheses in flat arrays: scores, tokens, frames of the
+                 tokens and offsets, hypothesis i holding tokens
+                 offsets[i] to offsets[i + 1]. get_text(i, vocabulary)
+                 builds the text of hypothesis i, faster given a
+                 Detokenizer of the vocabulary.
+        :rtype: BeamResults
+        """
+        return swig_decoders.BeamDecoder.decode_tokens(self, probs_seq.tolist())
+
+    def get_word_confidences(self):
+        """Confidence of each decoded word, the share of the beam's
+        posterior mass agreeing on the word. Only computed after
+        set_word_confidences(True), as it walks the words of every
+        hypothesis.
+
+        :return: List of confidences in [0, 1], one per word of the word
+                 timestamps, -1 each if not enabled.
+        :rtype: list
+        """
+        confidences = swig_decoders.FloatVector()
+        swig_decoders.BeamDecoder.get_word_confidences(self, confidences)
+        return list(confidences)
+
+
+def _beam_results(beam_results, scores=None):
+    if scores is None:
+        return [(res[0], res[1]) for res in beam_results]
+    return [(res[0], res[1], score.acoustic, score.lm, score.num_words)
+            for res, score in zip(beam_results, scores)]
+
+
+def _to_list(values):
+    # numpy scalars do not convert to the SWIG vectors
+    return values.tolist() if hasattr(values, 'tolist') else list(values)
+
 
 def ctc_greedy_decoder(probs_seq, vocabulary):
     """Wrapper for ctc best path decoder in swig.
@@ -60,12 +225,72 @@ def ctc_greedy_decoder(probs_seq, vocabulary):
     return result
 
 
+def _greedy_result(result):
+    return (result.text, list(result.tokens), list(result.start_frames),
+            list(result.end_frames))
+
+
+def ctc_greedy_decoder_batch(probs_split, vocabulary, num_processes=1):
+    """Wrapper for the batched greedy decoder over float32 frames.
+
+    :param probs_split: 2-D arrays of probabilities, log probabilities or
+                        logits per sample, the blank last.
+    :type probs_split: list
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param num_processes: Number of parallel processes.
+    :type num_processes: int
+    :return: List of (text, tokens, start_frames, end_frames) per sample,
+             the frames spanning each token of the best path.
+    :rtype: list
+    """
+    # the frames reach C++ as one float32 buffer rather than a list of
+    # Python floats
+    chunks, utterance_offsets = [], [0]
+    for probs_seq in probs_split:
+        chunks.append(probs_seq.astype('float32', order='C').tobytes())
+        utterance_offsets.append(utterance_offsets[-1] + len(probs_seq))
+    probs = memoryview(b''.join(chunks)).cast('f')
+    results = swig_decoders.ctc_greedy_decoder_batch(
+        probs, utterance_offsets, vocabulary, num_processes)
+    return [_greedy_result(result) for result in results]
+
+
+class GreedyDecoder(swig_decoders.GreedyDecoder):
+    """Wrapper for GreedyDecoder, the streaming greedy decoder.
+
+    :param vocabulary: Vocabulary list, without the blank.
+    :type vocabulary: list
+    """
+
+    def __init__(self, vocabulary):
+        swig_decoders.GreedyDecoder.__init__(self, vocabulary)
+
+    def decode(self, probs_seq):
+        """Decode the next chunk of frames.
+
+        :param probs_seq: 2-D array of the chunk, the blank last.
+        :type probs_seq: numpy.ndarray
+        :return: (text, tokens, start_frames, end_frames) of the stream so
+                 far, frames counted from its start.
+        :rtype: tuple
+        """
+        # a C-contiguous float32 array is passed as is, without a copy
+        result = swig_decoders.GreedyDecoder.decode(
+            self, probs_seq.astype('float32', order='C', copy=False))
+        return _greedy_result(result)
+
+
 def ctc_beam_search_decoder(probs_seq,
                             vocabulary,
                             beam_size,
                             cutoff_prob=1.0,
                             cutoff_top_n=40,
-                            ext_scoring_func=None):
+                            ext_scoring_func=None,
+                            stats=None,
+                            lattice=None,
+                            with_scores=False,
+                            context_biasing=None):
     """Wrapper for the CTC Beam Search Decoder.
 
     :param probs_seq: 2-D list of probability distributions over each time
@@ -87,15 +312,133 @@ def ctc_beam_search_decoder(probs_seq,
                              partially decoded sentence, e.g. word count
                              or language model.
     :type external_scoring_func: callable
+    :param stats: Optional DecoderStats accumulating counters and timings.
+    :type stats: DecoderStats
+    :param lattice: Optional Lattice filled with the word lattice of the
+                    results, with acoustic and LM scores on separate arcs.
+    :type lattice: Lattice
+    :param with_scores: Also return the acoustic log probability, LM log
+                        probability and word count of each result, such that
+                        score = acoustic + alpha * lm + beta * num_words,
+                        plus the boosts of context_biasing.
+    :type with_scores: bool
+    :param context_biasing: Optional phrases to boost.
+    :type context_biasing: ContextBiasing
     :return: List of tuples of log probability and sentence as decoding
-             results, in descending order of the probability.
+             results, in descending order of the probability, extended
+             with acoustic, lm and num_words if with_scores.
     :rtype: list
     """
+    scores = swig_decoders.HypothesisScoreVector() if with_scores else None
     beam_results = swig_decoders.ctc_beam_search_decoder(
         probs_seq.tolist(), vocabulary, beam_size, cutoff_prob, cutoff_top_n,
-        ext_scoring_func)
-    beam_results = [(res[0], res[1]) for res in beam_results]
-    return beam_results
+        ext_scoring_func, stats, lattice, scores, context_biasing)
+    return _beam_results(beam_results, scores)
+
+
+def ctc_hybrid_decoder(probs_seq,
+                       vocabulary,
+                       beam_size,
+                       min_confidence=0.9,
+                       context_frames=5,
+                       cutoff_prob=1.0,
+                       cutoff_top_n=40,
+                       ext_scoring_func=None,
+                       stats=None):
+    """Wrapper for the CTC Decoder beam searching only the uncertain frames
+    and keeping the greedy path elsewhere.
+
+    :param probs_seq: 2-D list of probability distributions over each time
+                      step, with each element being a list of normalized
+                      probabilities over vocabulary and blank.
+    :type probs_seq: 2-D list
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param beam_size: Width for beam search.
+    :type beam_size: int
+    :param min_confidence: Frames whose best token has a lower probability
+                           are beam searched, default 0.9.
+    :type min_confidence: float
+    :param context_frames: Frames also beam searched on each side of the
+                           uncertain ones, default 5.
+    :type context_frames: int
+    :param cutoff_prob: Cutoff probability in pruning,
+                        default 1.0, no pruning.
+    :type cutoff_prob: float
+    :param cutoff_top_n: Cutoff number in pruning, default 40.
+    :type cutoff_top_n: int
+    :param ext_scoring_func: External scoring function for
+                             partially decoded sentence, e.g. word count
+                             or language model.
+    :type external_scoring_func: callable
+    :param stats: Optional DecoderStats accumulating counters and timings of
+                  the beam searched frames.
+    :type stats: DecoderStats
+    :return: Tuple of log probability and sentence, the log probability of
+             the greedy frames being that of their best path.
+    :rtype: tuple
+    """
+    score, text = swig_decoders.ctc_hybrid_decoder(
+        probs_seq.tolist(), vocabulary, beam_size, min_confidence,
+        context_frames, cutoff_prob, cutoff_top_n, ext_scoring_func, stats)
+    return score, text
+
+
+def ctc_beam_search_decoder_sparse(token_ids,
+                                   log_probs,
+                                   row_offsets,
+                                   vocabulary,
+                                   beam_size,
+                                   cutoff_prob=1.0,
+                                   cutoff_top_n=40,
+                                   ext_scoring_func=None,
+                                   stats=None,
+                                   lattice=None,
+                                   with_scores=False,
+                                   context_biasing=None):
+    """Wrapper for the CTC Beam Search Decoder over sparse top-k frames.
+
+    :param token_ids: Token ids of all frames, concatenated.
+    :type token_ids: 1-D list
+    :param log_probs: Log probabilities matching token_ids.
+    :type log_probs: 1-D list
+    :param row_offsets: Frame t holds the entries from row_offsets[t] to
+                        row_offsets[t + 1], one more offset than frames. The
+                        blank, id len(vocabulary), must be in every frame.
+    :type row_offsets: 1-D list
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param beam_size: Width for beam search.
+    :type beam_size: int
+    :param cutoff_prob: Cutoff probability in pruning,
+                        default 1.0, frames used as given.
+    :type cutoff_prob: float
+    :param cutoff_top_n: Cutoff number in pruning, default 40.
+    :type cutoff_top_n: int
+    :param ext_scoring_func: External scoring function for
+                             partially decoded sentence, e.g. word count
+                             or language model.
+    :type external_scoring_func: callable
+    :param stats: Optional DecoderStats accumulating counters and timings.
+    :type stats: DecoderStats
+    :param lattice: Optional Lattice filled with the word lattice of the
+                    results.
+    :type lattice: Lattice
+    :param with_scores: Also return acoustic, lm and num_words of each
+                        result, see ctc_beam_search_decoder().
+    :type with_scores: bool
+    :param context_biasing: Optional phrases to boost.
+    :type context_biasing: ContextBiasing
+    :return: List of tuples of log probability and sentence as decoding
+             results, in descending order of the probability.
+    :rtype: list
+    """
+    scores = swig_decoders.HypothesisScoreVector() if with_scores else None
+    beam_results = swig_decoders.ctc_beam_search_decoder_sparse(
+        _to_list(token_ids), _to_list(log_probs), _to_list(row_offsets),
+        vocabulary, beam_size, cutoff_prob, cutoff_top_n, ext_scoring_func,
+        stats, lattice, scores, context_biasing)
+    return _beam_results(beam_results, scores)
 
 
 def ctc_beam_search_decoder_batch(probs_split,
@@ -104,7 +447,9 @@ def ctc_beam_search_decoder_batch(probs_split,
                                   num_processes,
                                   cutoff_prob=1.0,
                                   cutoff_top_n=40,
-                                  ext_scoring_func=None):
+                                  ext_scoring_func=None,
+                                  stats=None,
+                                  context_biasing=None):
     """Wrapper for the batched CTC beam search decoder.
 
     :param probs_seq: 3-D list with each element as an instance of 2-D list
@@ -129,6 +474,11 @@ def ctc_beam_search_decoder_batch(probs_split,
                              partially decoded sentence, e.g. word count
                              or language model.
     :type external_scoring_function: callable
+    :param stats: Optional DecoderStats accumulating counters and timings
+                  merged over the batch.
+    :type stats: DecoderStats
+    :param context_biasing: Optional phrases to boost in every sample.
+    :type context_biasing: ContextBiasing
     :return: List of tuples of log probability and sentence as decoding
              results, in descending order of the probability.
     :rtype: list
@@ -137,7 +487,195 @@ def ctc_beam_search_decoder_batch(probs_split,
 
     batch_beam_results = swig_decoders.ctc_beam_search_decoder_batch(
         probs_split, vocabulary, beam_size, num_processes, cutoff_prob,
-        cutoff_top_n, ext_scoring_func)
+        cutoff_top_n, ext_scoring_func, stats, context_biasing)
+    batch_beam_results = [
+        [(res[0], res[1]) for res in beam_results]
+        for beam_results in batch_beam_results
+    ]
+    return batch_beam_results
+
+
+def ctc_beam_search_decoder_sparse_batch(sparse_split,
+                                         vocabulary,
+                                         beam_size,
+                                         num_processes,
+                                         cutoff_prob=1.0,
+                                         cutoff_top_n=40,
+                                         ext_scoring_func=None,
+                                         stats=None,
+                                         context_biasing=None):
+    """Wrapper for the batched CTC beam search decoder over sparse frames.
+
+    :param sparse_split: List of (token_ids, log_probs, row_offsets) per
+                         sample, each as taken by
+                         ctc_beam_search_decoder_sparse().
+    :type sparse_split: list
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param beam_size: Width for beam search.
+    :type beam_size: int
+    :param num_processes: Number of parallel processes.
+    :type num_processes: int
+    :param cutoff_prob: Cutoff probability in pruning,
+                        default 1.0, frames used as given.
+    :type cutoff_prob: float
+    :param cutoff_top_n: Cutoff number in pruning, default 40.
+    :type cutoff_top_n: int
+    :param ext_scoring_func: External scoring function for
+                             partially decoded sentence, e.g. word count
+                             or language model.
+    :type external_scoring_function: callable
+    :param stats: Optional DecoderStats accumulating counters and timings
+                  merged over the batch.
+    :type stats: DecoderStats
+    :param context_biasing: Optional phrases to boost in every sample.
+    :type context_biasing: ContextBiasing
+    :return: List of decoding results per sample, each a list of tuples of
+             log probability and sentence in descending order of the
+             probability.
+    :rtype: list
+    """
+    # concatenate the samples into one CSR block
+    token_ids, log_probs, row_offsets, utterance_offsets = [], [], [0], [0]
+    for ids, values, offsets in sparse_split:
+        offsets = _to_list(offsets)
+        base = len(token_ids) - offsets[0]
+        token_ids.extend(_to_list(ids)[offsets[0]:offsets[-1]])
+        log_probs.extend(_to_list(values)[offsets[0]:offsets[-1]])
+        row_offsets.extend(offset + base for offset in offsets[1:])
+        utterance_offsets.append(len(row_offsets) - 1)
+
+    batch_beam_results = swig_decoders.ctc_beam_search_decoder_sparse_batch(
+        token_ids, log_probs, row_offsets, utterance_offsets, vocabulary,
+        beam_size, num_processes, cutoff_prob, cutoff_top_n, ext_scoring_func,
+        stats, context_biasing)
+    batch_beam_results = [
+        [(res[0], res[1]) for res in beam_results]
+        for beam_results in batch_beam_results
+    ]
+    return batch_beam_results
+
+
+def ctc_beam_search_grid_search(probs_split,
+                                references,
+                                vocabulary,
+                                beam_size,
+                                num_processes,
+                                alphas,
+                                betas,
+                                ext_scoring_func,
+                                cutoff_prob=1.0,
+                                cutoff_top_n=40):
+    """Wrapper for the native alpha/beta grid search.
+
+    :param probs_split: 3-D list with each element as an instance of 2-D list
+                        of probabilities used by ctc_beam_search_decoder().
+    :type probs_split: 3-D list
+    :param references: Reference transcript of each sample.
+    :type references: list
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param beam_size: Width for beam search.
+    :type beam_size: int
+    :param num_processes: Number of parallel processes, shared by all grid
+                          points and samples.
+    :type num_processes: int
+    :param alphas: Language model weights to try.
+    :type alphas: list
+    :param betas: Word insertion weights to try.
+    :type betas: list
+    :param ext_scoring_func: Scorer holding the language model, its own
+                             alpha and beta are left unchanged.
+    :type ext_scoring_func: Scorer
+    :param cutoff_prob: Cutoff probability in pruning,
+                        default 1.0, no pruning.
+    :type cutoff_prob: float
+    :param cutoff_top_n: Cutoff number in pruning, default 40.
+    :type cutoff_top_n: int
+    :return: List of tuples of alpha, beta and the corpus WER, for every
+             pair of alphas and betas.
+    :rtype: list
+    """
+    probs_split = [probs_seq.tolist() for probs_seq in probs_split]
+    alphas = [float(alpha) for alpha in alphas]
+    betas = [float(beta) for beta in betas]
+    wers = swig_decoders.ctc_beam_search_grid_search(
+        probs_split, references, vocabulary, beam_size, num_processes,
+        alphas, betas, ext_scoring_func, cutoff_prob, cutoff_top_n)
+    return [(alphas[i // len(betas)], betas[i % len(betas)], wer)
+            for i, wer in enumerate(wers)]
+
+
+def error_rates(hypotheses,
+                references,
+                char_level=False,
+                remove_space=False,
+                num_processes=1):
+    """Native batched edit distance for WER or CER.
+
+    :param hypotheses: Decoded sentences.
+    :type hypotheses: list
+    :param references: Reference sentence of each hypothesis.
+    :type references: list
+    :param char_level: Count UTF-8 character errors (CER) instead of word
+                       errors (WER).
+    :type char_level: bool
+    :param remove_space: Drop spaces before comparing characters.
+    :type remove_space: bool
+    :param num_processes: Number of parallel processes.
+    :type num_processes: int
+    :return: ErrorRates with the ErrorCounts (substitutions, deletions,
+             insertions, ref_length) of every utterance in utterances,
+             their sum in total and the corpus rate from error_rate().
+    :rtype: ErrorRates
+    """
+    return swig_decoders.error_rates(hypotheses, references, char_level,
+                                     remove_space, num_processes)
+
+
+def ctc_beam_search_decoder_file(posterior_path,
+                                 vocabulary,
+                                 beam_size,
+                                 num_processes,
+                                 cutoff_prob=1.0,
+                                 cutoff_top_n=40,
+                                 ext_scoring_func=None,
+                                 stats=None):
+    """Wrapper for the CTC beam search decoder over a posterior file.
+
+    :param posterior_path: Path of a file written by
+                           posterior_file.write_posterior_file(). The
+                           utterances are read by the decoding threads
+                           without going through Python.
+    :type posterior_path: basestring
+    :param vocabulary: Vocabulary list.
+    :type vocabulary: list
+    :param beam_size: Width for beam search.
+    :type beam_size: int
+    :param num_processes: Number of parallel processes.
+    :type num_processes: int
+    :param cutoff_prob: Cutoff probability in vocabulary pruning,
+                        default 1.0, no pruning.
+    :type cutoff_prob: float
+    :param cutoff_top_n: Cutoff number in pruning, only top cutoff_top_n
+                         characters with highest probs in vocabulary will be
+                         used in beam search, default 40.
+    :type cutoff_top_n: int
+    :param ext_scoring_func: External scoring function for
+                             partially decoded sentence, e.g. word count
+                             or language model.
+    :type external_scoring_function: callable
+    :param stats: Optional DecoderStats accumulating counters and timings
+                  merged over the file.
+    :type stats: DecoderStats
+    :return: List of decoding results per utterance, in file order, each a
+             list of tuples of log probability and sentence in descending
+             order of the probability.
+    :rtype: list
+    """
+    batch_beam_results = swig_decoders.ctc_beam_search_decoder_file(
+        posterior_path, vocabulary, beam_size, num_processes, cutoff_prob,
+        cutoff_top_n, ext_scoring_func, stats)
     batch_beam_results = [
         [(res[0], res[1]) for res in beam_results]
         for beam_results in batch_beam_results
@@ -1,8 +1,21 @@
 import numpy as np
+import os
 import pickle
+import tempfile
 import unittest
 
-from ctc_decoders import Scorer, ctc_beam_search_decoder
+from ctc_decoders import BeamDecoder, ContextBiasing, Lattice, Rescorer, Scorer
+from ctc_decoders import Detokenizer, WordMap
+from ctc_decoders import GreedyDecoder, ctc_greedy_decoder
+from ctc_decoders import ctc_greedy_decoder_batch
+from ctc_decoders import ctc_beam_search_decoder
+from ctc_decoders import ctc_beam_search_decoder_file
+from ctc_decoders import ctc_beam_search_decoder_sparse
+from ctc_decoders import ctc_beam_search_grid_search
+from ctc_decoders import ctc_hybrid_decoder
+from ctc_decoders import error_rates
+from posterior_file import write_posterior_file
+from swig_decoders import LogSumExpExact, LogSumExpFast
 
 
 def load_test_sample(pickle_file):
@@ -21,39 +34,22 @@ class CTCCustomDecoderTests(unittest.TestCase):
 
   def setUp(self):
     self.seq, self.label = load_test_sample('ctc-test.pickle')
-    self.vocab = [
-        " ",
-        "a",
-        "b",
-        "c",
-        "d",
-        "e",
-        "f",
-        "g",
-        "h",
-        "i",
-        "j",
-        "k",
-        "l",
-        "m",
-        "n",
-        "o",
-        "p",
-        "q",
-        "r",
-        "s",
-        "t",
-        "u",
-        "v",
-        "w",
-        "x",
-        "y",
-        "z",
-        "'"
-    ]
+    # the classes of the test model in this decoder's subword spelling:
+    # '▁' starts a word and every character continues one
+    self.vocab = ['▁'] + ['##' + c for c in "abcdefghijklmnopqrstuvwxyz'"]
+    # word map of the label's words; the first word of an utterance has no
+    # '▁' before it
+    fd, self.word_path = tempfile.mkstemp()
+    with os.fdopen(fd, 'w', encoding='utf-8') as f:
+      for i, word in enumerate(self.label.split(' ')):
+        pieces = list(word) if i == 0 else ['▁'] + list(word)
+        f.write(word + ' ' + ' '.join(pieces) + '\n')
     self.beam_width = 16
     self.tol = 1e-3
 
+  def tearDown(self):
+    os.remove(self.word_path)
+
 
   def test_decoders(self):
     '''
@@ -62,13 +58,391 @@ class CTCCustomDecoderTests(unittest.TestCase):
     logits = self.seq
     seq_len = [self.seq.shape[0]]
 
-    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary', vocabulary=self.vocab)
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
     res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
                                   beam_size=self.beam_width,
                                   ext_scoring_func=scorer)
     res_prob, decoded_text = res[0]
-    self.assertTrue( abs(4.0845 + res_prob) < self.tol )
-    self.assertTrue( decoded_text == self.label )
+    self.assertEqual( decoded_text, self.label )
+    scores = [score for score, _ in res]
+    self.assertEqual( scores, sorted(scores, reverse=True) )
+
+  def test_greedy_decoders(self):
+    '''
+    Batched and streaming greedy decoding agree with the greedy decoder.
+    '''
+    probs = softmax(self.seq.squeeze())
+    expected = ctc_greedy_decoder(probs, self.vocab)
+    res = ctc_greedy_decoder_batch([probs, probs[:10]], self.vocab, 2)
+    self.assertEqual( len(res), 2 )
+    text, tokens, start_frames, end_frames = res[0]
+    self.assertEqual( text, expected )
+    self.assertEqual( len(tokens), len(start_frames) )
+    self.assertTrue( all(s <= e for s, e in zip(start_frames, end_frames)) )
+    decoder = GreedyDecoder(self.vocab)
+    for start in range(0, probs.shape[0], 7):
+      streamed = decoder.decode(probs[start:start + 7])
+    self.assertEqual( streamed, res[0] )
+
+  def test_hybrid_decoder(self):
+    '''
+    Searching every frame decodes like the beam search, searching none like
+    the greedy decoder.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    probs = softmax(self.seq.squeeze())
+    full = ctc_beam_search_decoder(probs, self.vocab,
+                                   beam_size=self.beam_width,
+                                   ext_scoring_func=scorer)
+    score, text = ctc_hybrid_decoder(probs, self.vocab, self.beam_width,
+                                     min_confidence=1.1,
+                                     ext_scoring_func=scorer)
+    self.assertEqual( text, full[0][1] )
+    self.assertTrue( abs(score - full[0][0]) < self.tol )
+    score, text = ctc_hybrid_decoder(probs, self.vocab, self.beam_width,
+                                     min_confidence=0.0,
+                                     ext_scoring_func=scorer)
+    self.assertEqual( text, ctc_greedy_decoder(probs, self.vocab) )
+
+  def test_hybrid_decoder_cut(self):
+    '''
+    A window doesn't start at a blank followed by a '##' piece, so the
+    word's frames are searched as one, like the beam search does.
+    '''
+    vocab = ['▁', '##a', '##b', '##c']
+    probs = np.full((6, len(vocab) + 1), 0.01)
+    for t, token in enumerate([0, 1, 4, 2, 0, 3]):
+      probs[t, token] = 0.96
+    # the '##b' after the blank is the only uncertain frame
+    probs[3] = [0.02, 0.02, 0.5, 0.4, 0.06]
+    full = ctc_beam_search_decoder(probs, vocab, beam_size=8)
+    score, text = ctc_hybrid_decoder(probs, vocab, 8, min_confidence=0.9,
+                                     context_frames=0)
+    self.assertEqual( text, full[0][1] )
+    self.assertTrue( abs(score - full[0][0]) < self.tol )
+
+  def test_word_confidences(self):
+    '''
+    Word confidences are opt-in shares of the beam's mass, cleared on reset.
+    '''
+    decoder = BeamDecoder(self.vocab + ['<blank>'], self.beam_width)
+    probs = softmax(self.seq.squeeze())
+    decoder.decode(probs)
+    self.assertTrue( all(c == -1.0 for c in decoder.get_word_confidences()) )
+    decoder.reset()
+    decoder.set_word_confidences(True)
+    decoder.decode(probs)
+    confidences = decoder.get_word_confidences()
+    self.assertTrue( len(confidences) > 0 )
+    self.assertTrue( all(0.0 < c < 1.0 + self.tol for c in confidences) )
+    decoder.reset()
+    self.assertEqual( decoder.get_word_confidences(), [] )
+
+  def test_decode_tokens(self):
+    '''
+    Token results hold the hypotheses of decode, text built on demand.
+    '''
+    vocab = self.vocab + ['<blank>']
+    probs = softmax(self.seq.squeeze())
+    decoder = BeamDecoder(vocab, self.beam_width)
+    expected = decoder.decode(probs)
+    decoder.reset()
+    results = decoder.decode_tokens(probs)
+    self.assertEqual( results.size(), len(expected) )
+    self.assertEqual( len(results.offsets), len(expected) + 1 )
+    self.assertEqual( len(results.frames), len(results.tokens) )
+    detokenizer = Detokenizer(vocab)
+    for i, (score, text) in enumerate(expected):
+      self.assertEqual( results.get_text(i, vocab), text )
+      self.assertEqual( results.get_text(i, detokenizer), text )
+      self.assertTrue( abs(results.scores[i] - score) < self.tol )
+
+  def test_detokenizer(self):
+    '''
+    Continuations join the word before, word map pieces map back to ids.
+    '''
+    detokenizer = Detokenizer(['▁', 'he', '##llo', 'wo'])
+    self.assertEqual( detokenizer.detokenize([1, 2, 0, 3]), 'hello  wo' )
+    self.assertEqual( detokenizer.detokenize([]), '' )
+    pieces = ['▁', '▁he', 'llo', '▁wo', 'wo']
+    self.assertEqual( [detokenizer.piece_to_token(p) for p in pieces],
+                      [0, 1, 2, 3, -1] )
+
+  def test_decoder_file(self):
+    '''
+    Decoding from a float32 posterior file matches decoding the arrays.
+    '''
+    probs = softmax(self.seq.squeeze())
+    utterances = [probs, probs[:probs.shape[0] // 2]]
+    fd, path = tempfile.mkstemp()
+    os.close(fd)
+    try:
+      write_posterior_file(path, utterances, dtype='float32')
+      res = ctc_beam_search_decoder_file(path, self.vocab, self.beam_width, 2)
+    finally:
+      os.remove(path)
+    self.assertEqual( len(res), 2 )
+    for probs_seq, beam in zip(utterances, res):
+      expected = ctc_beam_search_decoder(probs_seq.astype(np.float32),
+                                         self.vocab,
+                                         beam_size=self.beam_width)
+      self.assertEqual( beam[0][1], expected[0][1] )
+      self.assertTrue( abs(beam[0][0] - expected[0][0]) < self.tol )
+
+
+  def test_decoder_sparse(self):
+    '''
+    Sparse frames holding every class decode like the dense frames.
+    '''
+    probs = softmax(self.seq.squeeze())
+    num_frames, num_classes = probs.shape
+    token_ids = np.tile(np.arange(num_classes), num_frames)
+    log_probs = np.log(probs.astype(np.float32).ravel() +
+                       np.finfo(np.float32).tiny)
+    row_offsets = np.arange(num_frames + 1) * num_classes
+    res = ctc_beam_search_decoder_sparse(token_ids, log_probs, row_offsets,
+                                         self.vocab,
+                                         beam_size=self.beam_width)
+    expected = ctc_beam_search_decoder(probs, self.vocab,
+                                       beam_size=self.beam_width)
+    self.assertEqual( res[0][1], expected[0][1] )
+    self.assertTrue( abs(res[0][0] - expected[0][0]) < self.tol )
+
+
+  def test_grid_search(self):
+    '''
+    Grid search keeps the scorer's weights and reports the WER of a
+    beam search at each pair of weights.
+    '''
+    scorer = Scorer(alpha=0.0, beta=0.0, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    probs = softmax(self.seq.squeeze())
+    res = ctc_beam_search_grid_search([probs, probs], [self.label] * 2,
+                                      self.vocab, self.beam_width, 2,
+                                      alphas=[0.0, 2.0], betas=[0.5],
+                                      ext_scoring_func=scorer)
+    self.assertEqual( [(a, b) for a, b, _ in res], [(0.0, 0.5), (2.0, 0.5)] )
+    self.assertEqual( (scorer.alpha, scorer.beta), (0.0, 0.0) )
+    for alpha, beta, wer in res:
+      scorer.reset_params(alpha, beta)
+      text = ctc_beam_search_decoder(probs, self.vocab,
+                                     beam_size=self.beam_width,
+                                     ext_scoring_func=scorer)[0][1]
+      rates = error_rates([text] * 2, [self.label] * 2)
+      self.assertTrue( abs(wer - rates.error_rate()) < 1e-12 )
+
+
+  def test_lattice(self):
+    '''
+    The best lattice path scores the best hypothesis.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    lattice = Lattice()
+    res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                  beam_size=self.beam_width,
+                                  ext_scoring_func=scorer, lattice=lattice)
+    self.assertEqual( len(lattice.final_states), len(res) )
+    arc_into = dict((arc.to_state, arc) for arc in lattice.arcs)
+    state, score, words = lattice.final_states[0], lattice.final_acoustic[0], []
+    while state != 0:
+      arc = arc_into[state]
+      score += arc.acoustic + 2.0 * arc.lm + 0.5
+      words.insert(0, arc.word)
+      state = arc.from_state
+    self.assertEqual( ' '.join(words), res[0][1] )
+    self.assertTrue( abs(score - res[0][0]) < self.tol )
+    self.assertFalse( lattice.write_fst('/nonexistent/lattice.fst', 2.0, 0.5) )
+
+
+  def test_hypothesis_scores(self):
+    '''
+    Score parts tracked during the search add up to the score.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                  beam_size=self.beam_width,
+                                  ext_scoring_func=scorer, with_scores=True)
+    for score, _, acoustic, lm, num_words in res:
+      self.assertTrue( abs(acoustic + 2.0 * lm + 0.5 * num_words - score) < self.tol )
+
+
+  def test_context_biasing(self):
+    '''
+    A completed phrase keeps the boosts of all its tokens.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    phrase = [self.vocab.index('▁' if c == ' ' else '##' + c)
+              for c in self.label]
+    biasing = ContextBiasing([phrase], 1.5)
+    self.assertEqual( biasing.num_phrases(), 1 )
+    plain = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                    beam_size=self.beam_width,
+                                    ext_scoring_func=scorer)
+    res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                  beam_size=self.beam_width,
+                                  ext_scoring_func=scorer,
+                                  context_biasing=biasing)
+    self.assertEqual( res[0][1], self.label )
+    self.assertEqual( plain[0][1], self.label )
+    self.assertTrue( abs(plain[0][0] + 1.5 * len(phrase) - res[0][0]) < self.tol )
+
+  def test_context_biasing_suffix(self):
+    '''
+    A phrase completed inside a longer phrase's failed match keeps its boosts.
+    '''
+    vocab = ['▁', '##a', '##b', '##c', '##d', '##x']
+    probs = np.full((4, len(vocab) + 1), 0.01)
+    for t, token in enumerate([1, 2, 3, 5]):
+      probs[t, token] = 1.0
+    probs /= probs.sum(axis=1, keepdims=True)
+    plain = ctc_beam_search_decoder(probs, vocab, beam_size=4)
+    biasing = ContextBiasing([[1, 2, 3, 4], [2, 3]], 1.0)
+    res = ctc_beam_search_decoder(probs, vocab, beam_size=4,
+                                  context_biasing=biasing)
+    self.assertEqual( res[0][1], 'abcx' )
+    self.assertTrue( abs(res[0][0] - plain[0][0] - 2.0) < self.tol )
+
+  def test_context_biasing_overlap(self):
+    '''
+    A match falling back to a phrase that extends a completed one earns the
+    completed phrase's boosts once.
+    '''
+    vocab = ['▁', '##a', '##b', '##c', '##d', '##x', '##e']
+    probs = np.full((4, len(vocab) + 1), 0.01)
+    for t, token in enumerate([1, 2, 3, 6]):
+      probs[t, token] = 1.0
+    probs /= probs.sum(axis=1, keepdims=True)
+    plain = ctc_beam_search_decoder(probs, vocab, beam_size=4)
+    biasing = ContextBiasing([[1, 2, 3, 4], [2, 3], [2, 3, 6]], 1.0)
+    res = ctc_beam_search_decoder(probs, vocab, beam_size=4,
+                                  context_biasing=biasing)
+    self.assertEqual( res[0][1], 'abce' )
+    self.assertTrue( abs(res[0][0] - plain[0][0] - 3.0) < self.tol )
+
+
+  def test_lexicon_overlay(self):
+    '''
+    Words added at runtime can be removed again, unknown pieces are refused.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    self.assertFalse( scorer.add_word('xyz', ['▁', 'xyz']) )
+    self.assertTrue( scorer.add_word('a', ['▁', 'a']) )
+    self.assertEqual( scorer.get_num_added_words(), 1 )
+    self.assertTrue( scorer.remove_word('a') )
+    self.assertFalse( scorer.remove_word('a') )
+    self.assertEqual( scorer.get_num_added_words(), 0 )
+
+
+  def test_word_map(self):
+    '''
+    The last spelling of a word wins, runs of spaces separate fields, lines
+    without pieces are skipped and a missing file reads as empty.
+    '''
+    detokenizer = Detokenizer(['▁', 'he', '##llo', 'wo'])
+    fd, path = tempfile.mkstemp()
+    with os.fdopen(fd, 'w', encoding='utf-8') as f:
+      f.write('hello ▁he llo\n\nhe  ▁he \nbad ▁he zz\nwo ▁wo\nwo ▁wo zz\n'
+              'he ▁he llo\nsolo\nlast  ▁wo llo')
+    word_map = WordMap()
+    word_map.load(path, detokenizer)
+    os.remove(path)
+    self.assertEqual( word_map.size(), 5 )
+    self.assertEqual( word_map.get_tokens('hello'), [1, 2] )
+    self.assertEqual( word_map.get_tokens('he'), [1, 2] )
+    self.assertEqual( word_map.get_tokens('bad'), [] )
+    self.assertEqual( word_map.get_tokens('wo'), [] )
+    self.assertEqual( word_map.get_tokens('solo'), [] )
+    self.assertEqual( word_map.get_tokens('last'), [3, 2] )
+    word_map.load('/nonexistent/words.txt', detokenizer)
+    self.assertEqual( word_map.size(), 0 )
+
+  def test_parallel_scorer(self):
+    '''
+    A scorer loaded on several threads has the same dictionary and decodes the same.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    parallel = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                      word_path=self.word_path, vocabulary=self.vocab,
+                      num_processes=4)
+    self.assertEqual( parallel.get_dict_size(), scorer.get_dict_size() )
+    stats = parallel.get_load_stats()
+    self.assertEqual( stats.num_lexicon_words, parallel.get_dict_size() )
+    self.assertTrue( stats.total_seconds >= stats.lm_seconds )
+    res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                  beam_size=self.beam_width,
+                                  ext_scoring_func=scorer)
+    res_parallel = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                           beam_size=self.beam_width,
+                                           ext_scoring_func=parallel)
+    self.assertEqual( res_parallel, res )
+
+
+  def test_rescorer(self):
+    '''
+    Rescoring acoustic scores with the decoding LM brings back the label.
+    '''
+    scorer = Scorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary',
+                    word_path=self.word_path, vocabulary=self.vocab)
+    res = ctc_beam_search_decoder(softmax(self.seq.squeeze()), self.vocab,
+                                  beam_size=self.beam_width,
+                                  ext_scoring_func=scorer, with_scores=True)
+    rescorer = Rescorer(alpha=2.0, beta=0.5, model_path='ctc-test-lm.binary')
+    nbest = [(acoustic, sentence) for _, sentence, acoustic, _, _ in res]
+    rescored = rescorer.rescore([nbest, nbest[::-1]], num_processes=2)
+    self.assertEqual( len(rescored), 2 )
+    self.assertEqual( rescored[0], rescored[1] )
+    self.assertEqual( rescored[0][0][1], self.label )
+    scores = [score for score, _ in rescored[0]]
+    self.assertEqual( scores, sorted(scores, reverse=True) )
+
+
+class ErrorRateTests(unittest.TestCase):
+
+  def test_word_errors(self):
+    rates = error_rates(['the cat sat', 'hello world', ''],
+                        ['the cat sat down', 'hello there world', 'a b'],
+                        num_processes=2)
+    counts = [(c.substitutions, c.deletions, c.insertions, c.ref_length)
+              for c in rates.utterances]
+    self.assertEqual( counts, [(0, 1, 0, 4), (0, 1, 0, 3), (0, 2, 0, 2)] )
+    self.assertEqual( rates.total.errors(), 4 )
+    self.assertTrue( abs(rates.error_rate() - 4.0 / 9) < 1e-12 )
+
+  def test_char_errors(self):
+    rates = error_rates(['süß', 'ab c'], ['suß', 'abc'], char_level=True,
+                        remove_space=True)
+    self.assertEqual( rates.utterances[0].substitutions, 1 )
+    self.assertEqual( rates.utterances[0].ref_length, 3 )
+    self.assertEqual( rates.utterances[1].errors(), 0 )
+
+
+class LogSumExpTests(unittest.TestCase):
+
+  def test_fast_matches_exact(self):
+    '''
+    Table approximation of log_sum_exp should stay within 1e-5 of exact.
+    '''
+    rng = np.random.RandomState(0)
+    xs = np.concatenate([rng.uniform(-50.0, 0.0, 2000),
+                         np.linspace(-20.0, 0.0, 2001)])
+    ys = np.concatenate([rng.uniform(-50.0, 0.0, 2000),
+                         np.zeros(2001)])
+    max_err = 0.0
+    for x, y in zip(xs, ys):
+      max_err = max(max_err, abs(LogSumExpExact(x, y) - LogSumExpFast(x, y)))
+    self.assertTrue( max_err < 1e-5 )
+
+  def test_fast_handles_inf(self):
+    num_min = -np.finfo(np.float64).max
+    self.assertEqual( LogSumExpFast(num_min, -3.0), -3.0 )
+    self.assertEqual( LogSumExpFast(-3.0, num_min), -3.0 )
 
 
 if __name__ == '__main__':
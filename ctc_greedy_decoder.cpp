@@ -1,6 +1,119 @@
 #include "ctc_greedy_decoder.h"
+
+#include <algorithm>
+#include <future>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "ThreadPool.h"
+
 #include "decoder_utils.h"
 
+// index of the first largest of values[0, n)
+static size_t argmax(const double* values, size_t n) {
+  size_t max_idx = 0;
+  for (size_t j = 1; j < n; ++j) {
+    if (values[max_idx] < values[j]) {
+      max_idx = j;
+    }
+  }
+  return max_idx;
+}
+
+// the same for floats, finding the largest value with vector max and then
+// its first position with vector compares
+static size_t argmax(const float* values, size_t n) {
+  size_t j = 0;
+  float max_value = -NUM_FLT_INF;
+#if defined(__AVX__)
+  if (n >= 8) {
+    __m256 max_vec = _mm256_loadu_ps(values);
+    for (j = 8; j + 8 <= n; j += 8) {
+      max_vec = _mm256_max_ps(max_vec, _mm256_loadu_ps(values + j));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, max_vec);
+    max_value = *std::max_element(lanes, lanes + 8);
+  }
+#elif defined(__SSE2__)
+  if (n >= 4) {
+    __m128 max_vec = _mm_loadu_ps(values);
+    for (j = 4; j + 4 <= n; j += 4) {
+      max_vec = _mm_max_ps(max_vec, _mm_loadu_ps(values + j));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, max_vec);
+    max_value = *std::max_element(lanes, lanes + 4);
+  }
+#endif
+  for (; j < n; ++j) {
+    max_value = std::max(max_value, values[j]);
+  }
+
+  j = 0;
+#if defined(__AVX__)
+  __m256 target = _mm256_set1_ps(max_value);
+  for (; j + 8 <= n; j += 8) {
+    int mask = _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(values + j), target, _CMP_EQ_OQ));
+    if (mask != 0) {
+      return j + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  __m128 target = _mm_set1_ps(max_value);
+  for (; j + 4 <= n; j += 4) {
+    int mask =
+        _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(values + j), target));
+    if (mask != 0) {
+      return j + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; j < n; ++j) {
+    if (values[j] == max_value) {
+      return j;
+    }
+  }
+  // only NaNs
+  return 0;
+}
+
+// extend a best path with the best class of one frame, last_token being the
+// best class of the previous frame
+static void greedy_step(size_t token,
+                        uint32_t frame,
+                        size_t blank_id,
+                        size_t& last_token,
+                        GreedyResult& result) {
+  if (token != blank_id) {
+    if (token != last_token) {
+      result.tokens.push_back(token);
+      result.start_frames.push_back(frame);
+      result.end_frames.push_back(frame);
+    } else {
+      result.end_frames.back() = frame;
+    }
+  }
+  last_token = token;
+}
+
+// greedy decode of num_frames contiguous frames
+static void greedy_frames(const float* probs,
+                          size_t num_frames,
+                          size_t num_classes,
+                          uint32_t first_frame,
+                          size_t& last_token,
+                          GreedyResult& result) {
+  size_t blank_id = num_classes - 1;
+  for (size_t t = 0; t < num_frames; ++t) {
+    size_t token = argmax(probs + t * num_classes, num_classes);
+    greedy_step(token, first_frame + t, blank_id, last_token, result);
+  }
+}
+
 std::string ctc_greedy_decoder(
     const std::vector<std::vector<double>> &probs_seq,
     const std::vector<std::string> &vocabulary) {
@@ -14,32 +127,115 @@ std::string ctc_greedy_decoder(
   }
 
   size_t blank_id = vocabulary.size();
-
-  std::vector<size_t> max_idx_vec(num_time_steps, 0);
-  std::vector<size_t> idx_vec;
+  size_t last_token = blank_id;
+  GreedyResult result;
   for (size_t i = 0; i < num_time_steps; ++i) {
-    double max_prob = 0.0;
-    size_t max_idx = 0;
-    const std::vector<double> &probs_step = probs_seq[i];
-    for (size_t j = 0; j < probs_step.size(); ++j) {
-      if (max_prob < probs_step[j]) {
-        max_idx = j;
-        max_prob = probs_step[j];
+    size_t token = argmax(probs_seq[i].data(), probs_seq[i].size());
+    greedy_step(token, i, blank_id, last_token, result);
+  }
+  return Detokenizer(vocabulary).detokenize(result.tokens);
+}
+
+std::vector<GreedyResult> ctc_greedy_decoder_batch(
+    const std::vector<float> &probs,
+    const std::vector<int> &utterance_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t num_processes) {
+  return ctc_greedy_decoder_batch(probs.data(),
+                                  probs.size(),
+                                  utterance_offsets,
+                                  vocabulary,
+                                  num_processes);
+}
+
+std::vector<GreedyResult> ctc_greedy_decoder_batch(
+    const float *probs,
+    size_t num_values,
+    const std::vector<int> &utterance_offsets,
+    const std::vector<std::string> &vocabulary,
+    size_t num_processes) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  VALID_CHECK_GT(utterance_offsets.size(), 0,
+                 "utterance_offsets must not be empty");
+  size_t num_classes = vocabulary.size() + 1;
+  size_t batch_size = utterance_offsets.size() - 1;
+  for (size_t i = 0; i < batch_size; ++i) {
+    VALID_CHECK(utterance_offsets[i] >= 0 &&
+                    utterance_offsets[i] <= utterance_offsets[i + 1],
+                "utterance_offsets must be nondecreasing");
+  }
+  VALID_CHECK(static_cast<size_t>(utterance_offsets[batch_size]) *
+                      num_classes <= num_values,
+              "The shape of probs does not match with "
+              "the shape of the vocabulary");
+
+  std::vector<GreedyResult> results(batch_size);
+  Detokenizer detokenizer(vocabulary);
+  // contiguous ranges of samples, a greedy decode being too short a task on
+  // its own
+  size_t num_tasks = std::min(num_processes, std::max<size_t>(batch_size, 1));
+  size_t chunk = (batch_size + num_tasks - 1) / num_tasks;
+  ThreadPool pool(num_tasks);
+  std::vector<std::future<void>> res;
+  for (size_t begin = 0; begin < batch_size; begin += chunk) {
+    size_t end = std::min(begin + chunk, batch_size);
+    res.emplace_back(pool.enqueue([&, begin, end]() {
+      for (size_t i = begin; i < end; ++i) {
+        size_t last_token = vocabulary.size();
+        greedy_frames(probs + utterance_offsets[i] * num_classes,
+                      utterance_offsets[i + 1] - utterance_offsets[i],
+                      num_classes,
+                      0,
+                      last_token,
+                      results[i]);
+        results[i].text = detokenizer.detokenize(results[i].tokens);
       }
-    }
-    // id with maximum probability in current time step
-    max_idx_vec[i] = max_idx;
-    // deduplicate
-    if ((i == 0) || ((i > 0) && max_idx_vec[i] != max_idx_vec[i - 1])) {
-      idx_vec.push_back(max_idx_vec[i]);
-    }
+    }));
   }
+  for (auto &r : res) {
+    r.get();
+  }
+  return results;
+}
 
-  std::string best_path_result;
-  for (size_t i = 0; i < idx_vec.size(); ++i) {
-    if (idx_vec[i] != blank_id) {
-      best_path_result += vocabulary[idx_vec[i]];
-    }
+GreedyDecoder::GreedyDecoder(const std::vector<std::string> &vocabulary)
+    : detokenizer_(vocabulary), blank_id_(vocabulary.size()) {
+  reset();
+}
+
+GreedyResult GreedyDecoder::decode(const std::vector<float> &probs) {
+  return decode(probs.data(), probs.size());
+}
+
+GreedyResult GreedyDecoder::decode(const float *probs, size_t num_values) {
+  size_t num_classes = blank_id_ + 1;
+  VALID_CHECK_EQ(num_values % num_classes,
+                 0,
+                 "The shape of probs does not match with "
+                 "the shape of the vocabulary");
+  size_t num_frames = num_values / num_classes;
+  size_t num_tokens = result_.tokens.size();
+  greedy_frames(probs,
+                num_frames,
+                num_classes,
+                num_frames_,
+                last_token_,
+                result_);
+  num_frames_ += num_frames;
+  // only the tokens of this chunk are detokenized, the earlier ones staying
+  // as they were
+  if (num_tokens > 0 && num_tokens < result_.tokens.size() &&
+      detokenizer_.starts_word(result_.tokens[num_tokens])) {
+    result_.text += ' ';
   }
-  return best_path_result;
+  detokenizer_.append(result_.tokens.data() + num_tokens,
+                      result_.tokens.size() - num_tokens,
+                      result_.text);
+  return result_;
+}
+
+void GreedyDecoder::reset() {
+  last_token_ = blank_id_;
+  num_frames_ = 0;
+  result_ = GreedyResult();
 }
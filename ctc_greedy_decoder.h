@@ -1,9 +1,23 @@
 #ifndef CTC_GREEDY_DECODER_H
 #define CTC_GREEDY_DECODER_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "detokenizer.h"
+
+/* Best path of a greedy decode: the text detokenized like the beam search
+ * results, and for each emitted token the first and last frame it was the
+ * best class in.
+ */
+struct GreedyResult {
+  std::string text;
+  std::vector<int> tokens;
+  std::vector<uint32_t> start_frames;
+  std::vector<uint32_t> end_frames;
+};
+
 /* CTC Greedy (Best Path) Decoder
  *
  * Parameters:
@@ -17,4 +31,64 @@ std::string ctc_greedy_decoder(
     const std::vector<std::vector<double>>& probs_seq,
     const std::vector<std::string>& vocabulary);
 
+/* CTC Greedy Decoder for a batch of contiguous float frames
+ *
+ * Parameters:
+ *     probs: Frames of all samples, row-major, vocabulary.size() + 1
+ *            values per frame with the blank last. Log probabilities or
+ *            logits work as well, only the best class counts.
+ *     utterance_offsets: Sample i spans the frames
+ *                        [utterance_offsets[i], utterance_offsets[i + 1]).
+ *     vocabulary: A vector of vocabulary.
+ *     num_processes: Number of threads.
+ * Return:
+ *     The best path of each sample, frames counted from its start.
+ */
+std::vector<GreedyResult> ctc_greedy_decoder_batch(
+    const std::vector<float>& probs,
+    const std::vector<int>& utterance_offsets,
+    const std::vector<std::string>& vocabulary,
+    size_t num_processes);
+
+// same over num_values floats at probs, which Python fills from any
+// float32 buffer without a copy
+std::vector<GreedyResult> ctc_greedy_decoder_batch(
+    const float* probs,
+    size_t num_values,
+    const std::vector<int>& utterance_offsets,
+    const std::vector<std::string>& vocabulary,
+    size_t num_processes);
+
+/* Streaming greedy decoder over chunks of contiguous float frames.
+ *
+ * The last token is carried across chunks, so a token whose frames straddle
+ * a chunk boundary is emitted once.
+ *
+ * Example:
+ *     GreedyDecoder decoder(vocabulary);
+ *     for (auto &chunk : chunks) {
+ *       GreedyResult result = decoder.decode(chunk);
+ *     }
+ */
+class GreedyDecoder {
+public:
+  // vocabulary without the blank, the blank being the last class
+  GreedyDecoder(const std::vector<std::string>& vocabulary);
+
+  // decode a chunk of frames laid out as in ctc_greedy_decoder_batch() and
+  // return the best path of the stream so far
+  GreedyResult decode(const std::vector<float>& probs);
+  GreedyResult decode(const float* probs, size_t num_values);
+
+  // start a new stream
+  void reset();
+
+private:
+  Detokenizer detokenizer_;
+  size_t blank_id_;
+  size_t last_token_;
+  uint32_t num_frames_;
+  GreedyResult result_;
+};
+
 #endif  // CTC_GREEDY_DECODER_H
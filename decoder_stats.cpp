@@ -0,0 +1,57 @@
+#include "decoder_stats.h"
+
+#include <algorithm>
+
+#ifdef DECODER_STATS
+thread_local DecoderStats *current_decoder_stats = nullptr;
+#endif
+
+DecoderStats::DecoderStats() { reset(); }
+
+void DecoderStats::reset() {
+  frames = 0;
+  nodes_created = 0;
+  nodes_freed = 0;
+  matcher_finds = 0;
+  lm_calls = 0;
+  beam_size_sum = 0;
+  beam_size_max = 0;
+
+  init_seconds = 0.0;
+  prune_seconds = 0.0;
+  extend_seconds = 0.0;
+  lm_seconds = 0.0;
+  iterate_seconds = 0.0;
+  select_seconds = 0.0;
+  result_seconds = 0.0;
+}
+
+void DecoderStats::merge(const DecoderStats &other) {
+  frames += other.frames;
+  nodes_created += other.nodes_created;
+  nodes_freed += other.nodes_freed;
+  matcher_finds += other.matcher_finds;
+  lm_calls += other.lm_calls;
+  beam_size_sum += other.beam_size_sum;
+  beam_size_max = std::max(beam_size_max, other.beam_size_max);
+
+  init_seconds += other.init_seconds;
+  prune_seconds += other.prune_seconds;
+  extend_seconds += other.extend_seconds;
+  lm_seconds += other.lm_seconds;
+  iterate_seconds += other.iterate_seconds;
+  select_seconds += other.select_seconds;
+  result_seconds += other.result_seconds;
+}
+
+double DecoderStats::mean_beam_size() const {
+  return frames == 0 ? 0.0 : static_cast<double>(beam_size_sum) / frames;
+}
+
+bool DecoderStats::enabled() {
+#ifdef DECODER_STATS
+  return true;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,134 @@
+#ifndef DECODER_STATS_H_
+#define DECODER_STATS_H_
+
+#include <chrono>
+#include <cstddef>
+
+/* Per-decode counters and stage timings.
+ *
+ * Collection is compiled in only when building with -DDECODER_STATS
+ * (setup.py --decoder_stats), otherwise every DECODER_STATS_* macro expands
+ * to nothing and the structure stays zero. Counters are recorded into the
+ * DecoderStats registered for the calling thread by DECODER_STATS_SCOPE, so
+ * the batch decoder gets one instance per utterance and merges them.
+ *
+ * Stage timings are exclusive, except lm_seconds which is the part of
+ * extend_seconds spent in language model queries.
+ */
+struct DecoderStats {
+  DecoderStats();
+
+  // zero all counters and timings
+  void reset();
+
+  // accumulate the counters and timings of other
+  void merge(const DecoderStats &other);
+
+  // average number of active prefixes per frame
+  double mean_beam_size() const;
+
+  // true if the decoders were built with -DDECODER_STATS
+  static bool enabled();
+
+  size_t frames;
+  size_t nodes_created;
+  size_t nodes_freed;
+  size_t matcher_finds;
+  size_t lm_calls;
+  // active prefixes summed over frames, and their maximum
+  size_t beam_size_sum;
+  size_t beam_size_max;
+
+  // seconds spent creating the root and copying the dictionary
+  double init_seconds;
+  // seconds spent pruning the vocabulary of each frame
+  double prune_seconds;
+  // seconds spent extending prefixes, including matcher and LM lookups
+  double extend_seconds;
+  double lm_seconds;
+  // seconds spent in iterate_to_vec
+  double iterate_seconds;
+  // seconds spent sorting and selecting the top beam_size prefixes
+  double select_seconds;
+  // seconds spent rescoring the last words and building the results
+  double result_seconds;
+};
+
+#if defined(DECODER_STATS) && !defined(SWIG)
+
+// stats of the decode running on this thread, or nullptr
+extern thread_local DecoderStats *current_decoder_stats;
+
+// Registers stats for the current thread while in scope and measures the
+// time between consecutive laps.
+class DecoderStatsScope {
+public:
+  explicit DecoderStatsScope(DecoderStats *stats)
+      : prev_(current_decoder_stats),
+        last_(std::chrono::steady_clock::now()) {
+    current_decoder_stats = stats;
+  }
+  ~DecoderStatsScope() { current_decoder_stats = prev_; }
+
+  // add the time since the previous lap to field
+  void lap(double DecoderStats::*field) {
+    auto now = std::chrono::steady_clock::now();
+    if (current_decoder_stats != nullptr) {
+      current_decoder_stats->*field +=
+          std::chrono::duration<double>(now - last_).count();
+    }
+    last_ = now;
+  }
+
+private:
+  DecoderStats *prev_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+// Adds the lifetime of the timer to field.
+class DecoderStatsTimer {
+public:
+  explicit DecoderStatsTimer(double DecoderStats::*field)
+      : field_(field), start_(std::chrono::steady_clock::now()) {}
+  ~DecoderStatsTimer() {
+    if (current_decoder_stats != nullptr) {
+      current_decoder_stats->*field_ += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start_).count();
+    }
+  }
+
+private:
+  double DecoderStats::*field_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define DECODER_STATS_SCOPE(stats) DecoderStatsScope decoder_stats_scope(stats)
+#define DECODER_STATS_LAP(field) \
+  decoder_stats_scope.lap(&DecoderStats::field)
+#define DECODER_STATS_TIMER(field) \
+  DecoderStatsTimer decoder_stats_timer_##field(&DecoderStats::field)
+#define DECODER_STATS_ADD(field, n)                 \
+  do {                                              \
+    if (current_decoder_stats != nullptr) {         \
+      current_decoder_stats->field += (n);          \
+    }                                               \
+  } while (0)
+#define DECODER_STATS_MAX(field, n)                             \
+  do {                                                          \
+    if (current_decoder_stats != nullptr &&                     \
+        current_decoder_stats->field < static_cast<size_t>(n)) { \
+      current_decoder_stats->field = (n);                       \
+    }                                                           \
+  } while (0)
+
+#else
+
+#define DECODER_STATS_SCOPE(stats) (void)(stats)
+#define DECODER_STATS_LAP(field)
+#define DECODER_STATS_TIMER(field)
+#define DECODER_STATS_ADD(field, n)
+#define DECODER_STATS_MAX(field, n)
+
+#endif  // DECODER_STATS
+
+#endif  // DECODER_STATS_H_
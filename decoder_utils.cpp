@@ -4,6 +4,15 @@
 #include <cmath>
 #include <limits>
 
+const Log1pExpTable LOG1P_EXP_TABLE;
+
+Log1pExpTable::Log1pExpTable() {
+  for (int i = 0; i < LSE_TABLE_SIZE; ++i) {
+    double d = static_cast<double>(i) / LSE_TABLE_RESOLUTION;
+    values[i] = static_cast<float>(std::log1p(std::exp(-d)));
+  }
+}
+
 std::vector<std::pair<size_t, float>> get_pruned_log_probs(
     const std::vector<double> &prob_step,
     double cutoff_prob,
@@ -37,12 +46,68 @@ std::vector<std::pair<size_t, float>> get_pruned_log_probs(
   return log_prob_idx;
 }
 
+void prune_log_prob_idx(std::vector<std::pair<size_t, float>> &log_prob_idx,
+                        double cutoff_prob,
+                        size_t cutoff_top_n) {
+  if (cutoff_prob >= 1.0) {
+    return;
+  }
+  std::sort(log_prob_idx.begin(),
+            log_prob_idx.end(),
+            pair_comp_second_rev<size_t, float>);
+  double cum_prob = 0.0;
+  size_t cutoff_len = 0;
+  for (size_t i = 0; i < log_prob_idx.size(); ++i) {
+    cum_prob += std::exp(log_prob_idx[i].second);
+    cutoff_len += 1;
+    if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n) break;
+  }
+  log_prob_idx.resize(cutoff_len);
+}
+
+
+// share of the posterior mass of results, normalized over the beam, whose
+// hypothesis has each word of the best one at overlapping frames
+static void get_word_confidences(
+    const std::vector<std::pair<double, std::string>> &results,
+    const std::vector<std::vector<std::tuple<std::string, uint32_t, uint32_t>>>
+        &word_lists,
+    std::vector<float> &confidences) {
+  std::vector<double> posteriors;
+  double total = 0.0;
+  for (const auto &result : results) {
+    posteriors.push_back(std::exp(result.first - results[0].first));
+    total += posteriors.back();
+  }
+  const auto &best_words = word_lists[0];
+  confidences.assign(best_words.size(), 0.0);
+  for (size_t i = 0; i < word_lists.size(); ++i) {
+    // both word lists are in time order, so one cursor walks each
+    const auto &words = word_lists[i];
+    size_t k = 0;
+    for (size_t j = 0; j < best_words.size(); ++j) {
+      uint32_t start = std::get<1>(best_words[j]);
+      uint32_t end = std::get<2>(best_words[j]);
+      while (k < words.size() && std::get<2>(words[k]) < start) {
+        ++k;
+      }
+      for (size_t m = k; m < words.size() && std::get<1>(words[m]) <= end;
+           ++m) {
+        if (std::get<0>(words[m]) == std::get<0>(best_words[j])) {
+          confidences[j] += posteriors[i] / total;
+          break;
+        }
+      }
+    }
+  }
+}
 
 std::vector<std::pair<double, std::string>> get_beam_search_result(
     const std::vector<PathTrie *> &prefixes,
-    const std::vector<std::string> &vocabulary,
+    const Detokenizer &detokenizer,
     size_t beam_size,
-    std::vector<std::tuple<std::string, uint32_t, uint32_t>>& wordlist) {
+    std::vector<std::tuple<std::string, uint32_t, uint32_t>>& wordlist,
+    std::vector<float> *word_confidences) {
   // allow for the post processing
   std::vector<PathTrie *> space_prefixes;
   if (space_prefixes.empty()) {
@@ -53,49 +118,27 @@ std::vector<std::pair<double, std::string>> get_beam_search_result(
 
   std::sort(space_prefixes.begin(), space_prefixes.end(), prefix_compare);
   std::vector<std::pair<double, std::string>> output_vecs;
-  std::vector<uint32_t> timestamps;
+  // word lists of the results needed, all of them for the confidences
+  std::vector<std::vector<std::tuple<std::string, uint32_t, uint32_t>>>
+      word_lists(word_confidences != nullptr ? space_prefixes.size() : 1);
   for (size_t i = 0; i < beam_size && i < space_prefixes.size(); ++i) {
     std::vector<int> output;
-    // request timestamp only for best result
-    space_prefixes[i]->get_path_vec2(output, vocabulary, i == 0 ? &timestamps : nullptr);
+    space_prefixes[i]->get_path_vec2(output);
     // convert index to string
-    std::string output_str;
-    for (int i = 0; i < output.size(); ++i) {
-      int ind = output[i];
-      if (vocabulary[ind].substr(0, 1) == "#") {
-        output_str += vocabulary[ind].substr(2);
-      } else {
-        if (i != 0) {
-          output_str += " ";
-        }
-        if (vocabulary[ind] != "▁") {
-          output_str += vocabulary[ind];
-        }
-      }
+    std::string output_str = detokenizer.detokenize(output);
+    if (i < word_lists.size()) {
+      space_prefixes[i]->get_words(detokenizer, word_lists[i]);
     }
-    // for (size_t j = 0; j < output.size(); j++) {
-    //   output_str += vocabulary[output[j]];
-    // }
     std::pair<double, std::string> output_pair(space_prefixes[i]->score,
                                                output_str);
     output_vecs.emplace_back(output_pair);
   }
 
-  // update word list with word and corresponding start & end times
-  wordlist.clear();
-  if (output_vecs[0].second.size() > 0) {
-    int ts_idx = 0;
-    char* saveptr;
-    char transcript[output_vecs[0].second.size() + 1];
-    strcpy(transcript, output_vecs[0].second.c_str());
-    char* token = strtok_r(transcript, " ", &saveptr);
-    while (token != NULL) {
-      std::tuple<std::string, uint32_t, uint32_t> word(std::string(token), timestamps[ts_idx], timestamps[ts_idx + 1]);
-      wordlist.emplace_back(word);
-      token = strtok_r(NULL, " ", &saveptr);
-      ts_idx += 2;
-    }
+  if (word_confidences != nullptr) {
+    get_word_confidences(output_vecs, word_lists, *word_confidences);
   }
+  // update word list with word and corresponding start & end times
+  wordlist.swap(word_lists[0]);
 
   return output_vecs;
 }
@@ -176,35 +219,32 @@ void add_word_to_fst(const std::vector<int> &word,
   dictionary->SetFinal(dst, fst::StdArc::Weight::One());
 }
 
+bool word_tokens_to_labels(
+    const std::vector<std::string> &word_tokens,
+    const Detokenizer &detokenizer,
+    std::vector<int> &labels) {
+  labels.clear();
+  for (const auto &piece : word_tokens) {
+    int token = detokenizer.piece_to_token(piece);
+    if (token < 0) {
+      return false;
+    }
+    labels.push_back(token + 1);
+  }
+  return true;
+}
+
 bool add_word_to_dictionary(
     const std::string &word,
     std::vector<std::string> &word_tokens,
-    const std::unordered_map<std::string, int> &char_map,
+    const Detokenizer &detokenizer,
     fst::StdVectorFst *dictionary) {
-
   std::vector<int> int_word;
-  bool no_oov = true;
-  std::string token; 
-  for (int i = 0; i < word_tokens.size(); ++i) {
-    if (word_tokens[i] == "▁") {
-      token = word_tokens[i];
-    } else {
-        if (word_tokens[i].substr(0, 3) == "▁") {
-            token = word_tokens[i].substr(3);
-        } else {
-          token = "##" + word_tokens[i];
-        }
-    }
-    auto int_c = char_map.find(token);
-    if (int_c != char_map.end()) {
-      int_word.push_back(int_c->second);
-    } else {
-      no_oov = false;
-      return no_oov;
-    }
-  }    
+  if (!word_tokens_to_labels(word_tokens, detokenizer, int_word)) {
+    return false;
+  }
   add_word_to_fst(int_word, dictionary);
-  return no_oov;
+  return true;
 }
 
 
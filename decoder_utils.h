@@ -2,6 +2,7 @@
 #define DECODER_UTILS_H_
 
 #include <utility>
+#include "detokenizer.h"
 #include "fst/log.h"
 #include "path_trie.h"
 
@@ -40,7 +41,7 @@ bool pair_comp_second_rev(const std::pair<T1, T2> &a,
 
 // Return the sum of two probabilities in log scale
 template <typename T>
-T log_sum_exp(const T &x, const T &y) {
+T log_sum_exp_exact(const T &x, const T &y) {
   static T num_min = -std::numeric_limits<T>::max();
   if (x <= num_min) return y;
   if (y <= num_min) return x;
@@ -48,18 +49,70 @@ T log_sum_exp(const T &x, const T &y) {
   return std::log(std::exp(x - xmax) + std::exp(y - xmax)) + xmax;
 }
 
+/* Lookup table of log(1 + exp(-d)) sampled every 1 / LSE_TABLE_RESOLUTION
+ * over [0, LSE_TABLE_RANGE]. With linear interpolation the absolute error
+ * is below 1e-5 (max f'' is 1/4, so h^2 / 32), and the tail clamped to zero
+ * beyond LSE_TABLE_RANGE contributes less than log1p(exp(-16)) ~= 1.2e-7.
+ */
+const int LSE_TABLE_RESOLUTION = 64;
+const int LSE_TABLE_RANGE = 16;
+const int LSE_TABLE_SIZE = LSE_TABLE_RANGE * LSE_TABLE_RESOLUTION + 1;
+
+struct Log1pExpTable {
+  Log1pExpTable();
+  float values[LSE_TABLE_SIZE];
+};
+
+extern const Log1pExpTable LOG1P_EXP_TABLE;
+
+// Return the sum of two probabilities in log scale, approximated by the
+// log1p(exp(-d)) table instead of calling exp and log
+template <typename T>
+T log_sum_exp_fast(const T &x, const T &y) {
+  static T num_min = -std::numeric_limits<T>::max();
+  if (x <= num_min) return y;
+  if (y <= num_min) return x;
+  T xmax = x > y ? x : y;
+  float pos = static_cast<float>(x > y ? x - y : y - x) * LSE_TABLE_RESOLUTION;
+  if (!(pos < LSE_TABLE_SIZE - 1)) return xmax;
+  int i = static_cast<int>(pos);
+  const float *v = LOG1P_EXP_TABLE.values;
+  return xmax + (v[i] + (pos - i) * (v[i + 1] - v[i]));
+}
+
+// Return the sum of two probabilities in log scale. Build with
+// -DFAST_LOG_SUM_EXP to use the table approximation in the decoders.
+template <typename T>
+T log_sum_exp(const T &x, const T &y) {
+#ifdef FAST_LOG_SUM_EXP
+  return log_sum_exp_fast(x, y);
+#else
+  return log_sum_exp_exact(x, y);
+#endif
+}
+
 // Get pruned probability vector for each time step's beam search
 std::vector<std::pair<size_t, float>> get_pruned_log_probs(
     const std::vector<double> &prob_step,
     double cutoff_prob,
     size_t cutoff_top_n);
 
-// Get beam search result from prefixes in trie tree
+// Prune one frame of (token, log prob) pairs the way get_pruned_log_probs()
+// prunes a dense frame. Frames are left untouched without cutoff_prob.
+void prune_log_prob_idx(std::vector<std::pair<size_t, float>> &log_prob_idx,
+                        double cutoff_prob,
+                        size_t cutoff_top_n);
+
+// Get beam search result from prefixes in trie tree, the words of the best
+// result with their start and end frames in wordlist and, if given, the
+// confidence of each of these words in word_confidences: the share of the
+// beam's posterior mass agreeing on the word
 std::vector<std::pair<double, std::string>> get_beam_search_result(
     const std::vector<PathTrie *> &prefixes,
-    const std::vector<std::string> &vocabulary,
+    const Detokenizer &detokenizer,
     size_t beam_size,
-    std::vector<std::tuple<std::string, uint32_t, uint32_t>>& wordlist);
+    std::vector<std::tuple<std::string, uint32_t, uint32_t>>& wordlist,
+    std::vector<float> *word_confidences = nullptr);
 
 // Functor for prefix comparsion
 bool prefix_compare(const PathTrie *x, const PathTrie *y);
@@ -85,11 +138,18 @@ std::vector<std::string> split_utf8_str(const std::string &str);
 void add_word_to_fst(const std::vector<int> &word,
                      fst::StdVectorFst *dictionary);
 
+// Map the pieces of a word in the word map to FST labels, the token ids
+// shifted by one, return false if a piece is out of the vocabulary
+bool word_tokens_to_labels(
+    const std::vector<std::string> &word_tokens,
+    const Detokenizer &detokenizer,
+    std::vector<int> &labels);
+
 // Add a word in string to dictionary
 bool add_word_to_dictionary(
     const std::string &word,
     std::vector<std::string> &word_tokens,
-    const std::unordered_map<std::string, int> &char_map,
+    const Detokenizer &detokenizer,
     fst::StdVectorFst *dictionary);
 #endif  // DECODER_UTILS_H
  
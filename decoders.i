@@ -1,23 +1,35 @@
 %module swig_decoders
 %{
+#include "decoder_stats.h"
+#include "detokenizer.h"
+#include "word_map.h"
 #include "scorer.h"
+#include "rescorer.h"
+#include "lattice.h"
 #include "ctc_greedy_decoder.h"
 #include "ctc_beam_search_decoder.h"
 #include "decoder_utils.h"
+#include "posterior_file.h"
+#include "error_rate.h"
+#include "context_biasing.h"
 %}
 
 %include "std_vector.i"
 %include "std_pair.i"
 %include "std_string.i"
+%include "stdint.i"
 %import "decoder_utils.h"
 
 namespace std {
     %template(DoubleVector) std::vector<double>;
     %template(IntVector) std::vector<int>;
+    %template(IntVector2) std::vector<std::vector<int> >;
     %template(StringVector) std::vector<std::string>;
     %template(VectorOfStructVector) std::vector<std::vector<double> >;
     %template(FloatVector) std::vector<float>;
+    %template(UInt32Vector) std::vector<uint32_t>;
     %template(Pair) std::pair<float, std::string>;
+    %template(PairDoubleString) std::pair<double, std::string>;
     %template(PairFloatStringVector)  std::vector<std::pair<float, std::string> >;
     %template(PairDoubleStringVector) std::vector<std::pair<double, std::string> >;
     %template(PairDoubleStringVector2) std::vector<std::vector<std::pair<double, std::string> > >;
@@ -27,7 +39,45 @@ namespace std {
 %template(IntDoublePairCompSecondRev) pair_comp_second_rev<int, double>;
 %template(StringDoublePairCompSecondRev) pair_comp_second_rev<std::string, double>;
 %template(DoubleStringPairCompFirstRev) pair_comp_first_rev<double, std::string>;
+%template(LogSumExpExact) log_sum_exp_exact<double>;
+%template(LogSumExpFast) log_sum_exp_fast<double>;
 
+// float frames straight from a C-contiguous float32 buffer such as a numpy
+// array, without going through a list of Python floats
+%typemap(typecheck, precedence=SWIG_TYPECHECK_POINTER) (const float *probs, size_t num_values) {
+    $1 = PyObject_CheckBuffer($input);
+}
+%typemap(in) (const float *probs, size_t num_values) (Py_buffer view) {
+    view.obj = NULL;
+    if (PyObject_GetBuffer($input, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+        SWIG_fail;
+    }
+    if (view.itemsize != sizeof(float) || strcmp(view.format, "f") != 0) {
+        PyErr_SetString(PyExc_TypeError, "probs must be a contiguous float32 buffer");
+        SWIG_fail;
+    }
+    $1 = (float *)view.buf;
+    $2 = (size_t)(view.len / sizeof(float));
+}
+%typemap(freearg) (const float *probs, size_t num_values) {
+    if (view$argnum.obj) {
+        PyBuffer_Release(&view$argnum);
+    }
+}
+
+%include "decoder_stats.h"
+%include "detokenizer.h"
+%include "word_map.h"
 %include "scorer.h"
+%include "rescorer.h"
+%include "lattice.h"
 %include "ctc_greedy_decoder.h"
+%include "context_biasing.h"
 %include "ctc_beam_search_decoder.h"
+%include "posterior_file.h"
+%include "error_rate.h"
+
+%template(GreedyResultVector) std::vector<GreedyResult>;
+%template(LatticeArcVector) std::vector<LatticeArc>;
+%template(HypothesisScoreVector) std::vector<HypothesisScore>;
+%template(ErrorCountsVector) std::vector<ErrorCounts>;
@@ -0,0 +1,42 @@
+#include "detokenizer.h"
+
+#include <algorithm>
+
+static const std::string WORD_START = "▁";
+
+Detokenizer::Detokenizer(const std::vector<std::string> &vocabulary) {
+  offsets_.push_back(0);
+  for (size_t i = 0; i < vocabulary.size(); ++i) {
+    const std::string &token = vocabulary[i];
+    bool continues = token.compare(0, 1, "#") == 0;
+    if (continues) {
+      bytes_.append(token, std::min<size_t>(2, token.size()), std::string::npos);
+      if (token.compare(0, 2, "##") == 0) {
+        pieces_[token.substr(2)] = i;
+      }
+    } else {
+      if (token != WORD_START) {
+        bytes_ += token;
+      }
+      pieces_[token == WORD_START ? token : WORD_START + token] = i;
+    }
+    offsets_.push_back(bytes_.size());
+    starts_word_.push_back(!continues);
+  }
+}
+
+void Detokenizer::append(const int *tokens,
+                         size_t num_tokens,
+                         std::string &text) const {
+  for (size_t i = 0; i < num_tokens; ++i) {
+    if (i != 0 && starts_word(tokens[i])) {
+      text += ' ';
+    }
+    append_token(tokens[i], text);
+  }
+}
+
+int Detokenizer::piece_to_token(const std::string &piece) const {
+  auto it = pieces_.find(piece);
+  return it != pieces_.end() ? it->second : -1;
+}
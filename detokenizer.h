@@ -0,0 +1,60 @@
+#ifndef DETOKENIZER_H_
+#define DETOKENIZER_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Text of token ids, for vocabularies of word pieces: a token starting
+ * with "#" continues the current word without its "##", any other starts
+ * a new word after a space, "▁" standing for an empty word start.
+ *
+ * The display bytes of every token and whether it starts a word are laid
+ * out once from the vocabulary, so joining tokens only copies bytes into
+ * the caller's buffer. It also maps the pieces of words as written in a
+ * word map back to token ids.
+ */
+class Detokenizer {
+public:
+  explicit Detokenizer(
+      const std::vector<std::string> &vocabulary = std::vector<std::string>());
+
+  size_t size() const { return starts_word_.size(); }
+
+  bool starts_word(int token) const { return starts_word_[token] != 0; }
+
+#ifndef SWIG
+  // append the display bytes of token, without a separator
+  void append_token(int token, std::string &text) const {
+    text.append(bytes_, offsets_[token], offsets_[token + 1] - offsets_[token]);
+  }
+
+  // append the text of tokens, the first one taking no separator
+  void append(const int *tokens, size_t num_tokens, std::string &text) const;
+  void append(const std::vector<int> &tokens, std::string &text) const {
+    append(tokens.data(), tokens.size(), text);
+  }
+#endif
+
+  std::string detokenize(const std::vector<int> &tokens) const {
+    std::string text;
+    append(tokens, text);
+    return text;
+  }
+
+  // token id of a word piece as written in a word map, "▁x" being the
+  // word start "x", "▁" itself and any other piece "x" the continuation
+  // "##x"; -1 if not in the vocabulary
+  int piece_to_token(const std::string &piece) const;
+
+private:
+  // display bytes of token i are bytes_[offsets_[i], offsets_[i + 1])
+  std::string bytes_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint8_t> starts_word_;
+  // ids by word map spelling, later tokens winning like in Scorer
+  std::unordered_map<std::string, int> pieces_;
+};
+
+#endif  // DETOKENIZER_H_
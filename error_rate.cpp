@@ -0,0 +1,118 @@
+#include "error_rate.h"
+
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+#include "decoder_utils.h"
+
+double ErrorCounts::error_rate() const {
+  if (ref_length == 0) {
+    return errors() == 0 ? 0.0 : 1.0;
+  }
+  return static_cast<double>(errors()) / ref_length;
+}
+
+void ErrorCounts::add(const ErrorCounts &other) {
+  substitutions += other.substitutions;
+  deletions += other.deletions;
+  insertions += other.insertions;
+  ref_length += other.ref_length;
+}
+
+static std::vector<std::string> split_units(const std::string &sentence,
+                                            bool char_level,
+                                            bool remove_space) {
+  if (!char_level) {
+    return split_str(sentence, " ");
+  }
+  std::vector<std::string> chars;
+  if (sentence.empty()) {
+    return chars;
+  }
+  chars = split_utf8_str(sentence);
+  if (remove_space) {
+    chars.erase(std::remove(chars.begin(), chars.end(), " "), chars.end());
+  }
+  return chars;
+}
+
+ErrorCounts error_counts(const std::string &hypothesis,
+                         const std::string &reference,
+                         bool char_level,
+                         bool remove_space) {
+  std::vector<std::string> hyp =
+      split_units(hypothesis, char_level, remove_space);
+  std::vector<std::string> ref =
+      split_units(reference, char_level, remove_space);
+
+  // one row of the alignment table, each cell keeping the operations of
+  // its cheapest path
+  std::vector<ErrorCounts> prev(hyp.size() + 1), cur(hyp.size() + 1);
+  for (size_t j = 1; j <= hyp.size(); ++j) {
+    prev[j].insertions = j;
+  }
+  for (size_t i = 1; i <= ref.size(); ++i) {
+    cur[0] = ErrorCounts();
+    cur[0].deletions = i;
+    for (size_t j = 1; j <= hyp.size(); ++j) {
+      if (ref[i - 1] == hyp[j - 1]) {
+        cur[j] = prev[j - 1];
+        continue;
+      }
+      // substitution, then deletion, then insertion on ties
+      const ErrorCounts *best = &prev[j - 1];
+      if (prev[j].errors() < best->errors()) best = &prev[j];
+      if (cur[j - 1].errors() < best->errors()) best = &cur[j - 1];
+      cur[j] = *best;
+      if (best == &prev[j - 1]) {
+        ++cur[j].substitutions;
+      } else if (best == &prev[j]) {
+        ++cur[j].deletions;
+      } else {
+        ++cur[j].insertions;
+      }
+    }
+    std::swap(prev, cur);
+  }
+  ErrorCounts counts = prev[hyp.size()];
+  counts.ref_length = ref.size();
+  return counts;
+}
+
+ErrorRates error_rates(const std::vector<std::string> &hypotheses,
+                       const std::vector<std::string> &references,
+                       bool char_level,
+                       bool remove_space,
+                       size_t num_processes) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  VALID_CHECK_EQ(hypotheses.size(),
+                 references.size(),
+                 "Every hypothesis needs one reference");
+  ErrorRates rates;
+  size_t batch_size = hypotheses.size();
+  rates.utterances.resize(batch_size);
+
+  // contiguous ranges rather than one task per utterance, which would cost
+  // more than aligning a short sentence
+  size_t num_tasks = std::min(num_processes, std::max<size_t>(batch_size, 1));
+  size_t chunk = (batch_size + num_tasks - 1) / num_tasks;
+  ThreadPool pool(num_tasks);
+  std::vector<std::future<void>> res;
+  for (size_t begin = 0; begin < batch_size; begin += chunk) {
+    size_t end = std::min(begin + chunk, batch_size);
+    res.emplace_back(pool.enqueue([&, begin, end]() {
+      for (size_t i = begin; i < end; ++i) {
+        rates.utterances[i] = error_counts(
+            hypotheses[i], references[i], char_level, remove_space);
+      }
+    }));
+  }
+  for (auto &r : res) {
+    r.get();
+  }
+  for (const auto &counts : rates.utterances) {
+    rates.total.add(counts);
+  }
+  return rates;
+}
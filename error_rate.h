@@ -0,0 +1,58 @@
+#ifndef ERROR_RATE_H_
+#define ERROR_RATE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* Edit operations aligning one hypothesis to its reference. */
+struct ErrorCounts {
+  size_t substitutions = 0;
+  size_t deletions = 0;
+  size_t insertions = 0;
+  // words or characters of the reference
+  size_t ref_length = 0;
+
+  size_t errors() const { return substitutions + deletions + insertions; }
+  // errors over reference length, 0 for an empty reference without errors
+  double error_rate() const;
+  void add(const ErrorCounts &other);
+};
+
+/* Error counts of a batch, per utterance and summed. */
+struct ErrorRates {
+  ErrorCounts total;
+  std::vector<ErrorCounts> utterances;
+
+  double error_rate() const { return total.error_rate(); }
+};
+
+/* Edit distance between two sentences
+ *
+ * Parameters:
+ *     hypothesis: Decoded sentence.
+ *     reference: Ground truth sentence.
+ *     char_level: Compare UTF-8 characters rather than space separated
+ *                 words.
+ *     remove_space: Drop the spaces before comparing characters, ignored
+ *                   at word level.
+ * Return:
+ *     The substitution, deletion and insertion counts of a minimum
+ *     alignment, and the reference length.
+ */
+ErrorCounts error_counts(const std::string &hypothesis,
+                         const std::string &reference,
+                         bool char_level = false,
+                         bool remove_space = false);
+
+/* Batched error counts, the utterances being split across num_processes
+ * threads. Return the counts of every utterance and their sum, from which
+ * the corpus WER (or CER) is total.error_rate().
+ */
+ErrorRates error_rates(const std::vector<std::string> &hypotheses,
+                       const std::vector<std::string> &references,
+                       bool char_level = false,
+                       bool remove_space = false,
+                       size_t num_processes = 1);
+
+#endif  // ERROR_RATE_H_
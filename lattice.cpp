@@ -0,0 +1,141 @@
+#include "lattice.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "decoder_utils.h"
+#include "detokenizer.h"
+
+void Lattice::clear() {
+  num_states = 0;
+  arcs.clear();
+  final_states.clear();
+  final_acoustic.clear();
+}
+
+fst::StdVectorFst *Lattice::to_fst(double alpha, double beta) const {
+  fst::StdVectorFst *lattice_fst = new fst::StdVectorFst;
+  fst::SymbolTable symbols("words");
+  symbols.AddSymbol("<eps>", 0);
+  for (size_t s = 0; s < num_states; ++s) {
+    lattice_fst->AddState();
+  }
+  if (num_states > 0) {
+    lattice_fst->SetStart(0);
+  }
+  for (const auto &arc : arcs) {
+    int label = symbols.AddSymbol(arc.word);
+    float cost = -(arc.acoustic + alpha * arc.lm + beta);
+    lattice_fst->AddArc(arc.from_state,
+                        fst::StdArc(label, label, cost, arc.to_state));
+  }
+  for (size_t i = 0; i < final_states.size(); ++i) {
+    lattice_fst->SetFinal(final_states[i], -final_acoustic[i]);
+  }
+  lattice_fst->SetInputSymbols(&symbols);
+  lattice_fst->SetOutputSymbols(&symbols);
+  return lattice_fst;
+}
+
+bool Lattice::write_fst(const std::string &path,
+                        double alpha,
+                        double beta) const {
+  std::unique_ptr<fst::StdVectorFst> lattice_fst(to_fst(alpha, beta));
+  return lattice_fst->Write(path);
+}
+
+void build_lattice(const std::vector<PathTrie *> &prefixes,
+                   size_t num_hypotheses,
+                   const std::vector<std::string> &vocabulary,
+                   Scorer *ext_scorer,
+                   const LexiconOverlay *lexicon_overlay,
+                   Lattice &lattice) {
+  lattice.clear();
+  bool use_lm = ext_scorer != nullptr && !ext_scorer->is_character_based();
+  num_hypotheses = std::min(num_hypotheses, prefixes.size());
+  if (num_hypotheses == 0) {
+    return;
+  }
+  lattice.num_states = 1;
+  Detokenizer detokenizer(vocabulary);
+
+  // state of each word end node, the root being state 0
+  std::unordered_map<const PathTrie *, int> states;
+  // arc entering each state but the start
+  std::vector<int> arc_into(1, -1);
+  // best acoustic log prob of the hypotheses through each state
+  std::vector<double> best_acoustic(1, -NUM_FLT_INF);
+  std::vector<double> hyp_acoustic(num_hypotheses);
+  std::vector<int> hyp_state(num_hypotheses);
+  std::vector<PathTrie *> path;
+  std::vector<int> path_states;
+
+  for (size_t h = 0; h < num_hypotheses; ++h) {
+    path.clear();
+    for (PathTrie *node = prefixes[h]; !node->is_empty(); node = node->parent) {
+      path.push_back(node);
+    }
+    std::reverse(path.begin(), path.end());
+
+    // walk the words from the root, adding the states and arcs not shared
+    // with earlier hypotheses
+    int state = 0;
+    path_states.assign(1, 0);
+    for (size_t begin = 0; begin < path.size();) {
+      size_t end = begin + 1;
+      while (end < path.size() &&
+             !detokenizer.starts_word(path[end]->character)) {
+        ++end;
+      }
+      PathTrie *word_end = path[end - 1];
+      auto it = states.find(word_end);
+      int next_state;
+      if (it != states.end()) {
+        next_state = it->second;
+      } else {
+        next_state = lattice.num_states++;
+        states[word_end] = next_state;
+
+        LatticeArc arc;
+        arc.from_state = state;
+        arc.to_state = next_state;
+        for (size_t i = begin; i < end; ++i) {
+          detokenizer.append_token(path[i]->character, arc.word);
+        }
+        // the same n-gram the search scored this word with
+        arc.lm = use_lm ? ext_scorer->get_log_cond_prob(
+                              ext_scorer->make_ngram(word_end),
+                              lexicon_overlay)
+                        : 0.0;
+        arc.acoustic = 0.0;
+        arc_into.push_back(lattice.arcs.size());
+        best_acoustic.push_back(-NUM_FLT_INF);
+        lattice.arcs.push_back(arc);
+      }
+      state = next_state;
+      path_states.push_back(state);
+      begin = end;
+    }
+
+    double acoustic = prefixes[h]->approx_ctc;
+    hyp_acoustic[h] = acoustic;
+    hyp_state[h] = state;
+    for (int s : path_states) {
+      best_acoustic[s] = std::max(best_acoustic[s], acoustic);
+    }
+  }
+
+  // push the acoustic scores: an arc carries the gain of its best
+  // hypothesis over the best one through its source state
+  for (size_t s = 1; s < lattice.num_states; ++s) {
+    LatticeArc &arc = lattice.arcs[arc_into[s]];
+    arc.acoustic = best_acoustic[s] -
+                   (arc.from_state == 0 ? 0.0 : best_acoustic[arc.from_state]);
+  }
+  for (size_t h = 0; h < num_hypotheses; ++h) {
+    int state = hyp_state[h];
+    lattice.final_states.push_back(state);
+    lattice.final_acoustic.push_back(
+        hyp_acoustic[h] - (state == 0 ? 0.0 : best_acoustic[state]));
+  }
+}
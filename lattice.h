@@ -0,0 +1,65 @@
+#ifndef LATTICE_H_
+#define LATTICE_H_
+
+#include <string>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+#include "path_trie.h"
+#include "scorer.h"
+
+/* Word arc of a Lattice. The search score of a path is the sum over its
+ * arcs of acoustic + alpha * lm + beta, plus the acoustic final weight of
+ * its last state. Contextual biasing boosts are not part of the lattice.
+ */
+struct LatticeArc {
+  int from_state;
+  int to_state;
+  std::string word;
+  // CTC log prob share of the arc, pushed towards the start so that the
+  // best path through each state collects it as early as possible
+  double acoustic;
+  // LM log10 prob of the word given its history, the same query the search
+  // scored it with; 0 without a word based scorer
+  double lm;
+};
+
+/* N-best word lattice of a beam search: the word sequences of the final
+ * beam merged on their shared prefixes, state 0 being the start. Each
+ * hypothesis ends in its own final state.
+ */
+struct Lattice {
+  size_t num_states = 0;
+  std::vector<LatticeArc> arcs;
+  std::vector<int> final_states;
+  // acoustic weight left at each final state
+  std::vector<double> final_acoustic;
+
+  void clear();
+
+#ifndef SWIG
+  // acceptor over the words with the search scores as tropical costs,
+  // i.e. -(acoustic + alpha * lm + beta) per arc; the word symbols are
+  // attached as input and output symbols. Owned by the caller.
+  fst::StdVectorFst *to_fst(double alpha, double beta) const;
+#endif
+
+  // write to_fst() to path in the OpenFst binary format, return false if
+  // it can't be written
+  bool write_fst(const std::string &path, double alpha, double beta) const;
+};
+
+/* Build the lattice of the first num_hypotheses prefixes, which must still
+ * be alive in their trie and have their approx_ctc set by the search. The
+ * acoustic weights are pushed from approx_ctc, which leaves out the LM,
+ * word insertion and biasing terms. lexicon_overlay is the snapshot of
+ * runtime words the search scored with. */
+void build_lattice(const std::vector<PathTrie *> &prefixes,
+                   size_t num_hypotheses,
+                   const std::vector<std::string> &vocabulary,
+                   Scorer *ext_scorer,
+                   const LexiconOverlay *lexicon_overlay,
+                   Lattice &lattice);
+
+#endif  // LATTICE_H_
@@ -0,0 +1,43 @@
+#include "lexicon_overlay.h"
+
+LexiconOverlay::LexiconOverlay() : nodes_(1) {}
+
+void LexiconOverlay::add_word(const std::string &word,
+                              const std::vector<int> &tokens) {
+  auto it = words_.find(word);
+  if (it != words_.end()) {
+    // drop the old spelling
+    it->second = tokens;
+    build();
+    return;
+  }
+  words_[word] = tokens;
+  int state = 0;
+  for (int token : tokens) {
+    int next = next_state(state, token);
+    if (next < 0) {
+      next = nodes_.size();
+      nodes_[state][token] = next;
+      nodes_.emplace_back();
+    }
+    state = next;
+  }
+}
+
+bool LexiconOverlay::remove_word(const std::string &word) {
+  if (words_.erase(word) == 0) {
+    return false;
+  }
+  // the overlay is small, rebuilding beats counting references per node
+  build();
+  return true;
+}
+
+void LexiconOverlay::build() {
+  nodes_.assign(1, std::map<int, int>());
+  auto words = std::move(words_);
+  words_.clear();
+  for (auto &word : words) {
+    add_word(word.first, word.second);
+  }
+}
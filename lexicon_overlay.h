@@ -0,0 +1,48 @@
+#ifndef LEXICON_OVERLAY_H_
+#define LEXICON_OVERLAY_H_
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Words added to a Scorer's lexicon at runtime, next to its determinized
+ * FST dictionary which is too costly to rebuild for every change.
+ *
+ * A small trie over token ids, walked by PathTrie::get_path_trie alongside
+ * the FST: a prefix extends if either of them accepts the token. Scorer
+ * swaps in an updated copy on every change, so decodes started earlier
+ * keep the words they started with and concurrent decodes can share one.
+ */
+class LexiconOverlay {
+public:
+  LexiconOverlay();
+
+  // add word spelled by tokens, replacing its spelling if present
+  void add_word(const std::string &word, const std::vector<int> &tokens);
+
+  // remove word, return false if absent
+  bool remove_word(const std::string &word);
+
+  bool contains(const std::string &word) const {
+    return words_.count(word) > 0;
+  }
+  size_t size() const { return words_.size(); }
+
+  // state after token from state, or -1 if no word continues with it;
+  // words start from state 0
+  int next_state(int state, int token) const {
+    auto &children = nodes_[state];
+    auto it = children.find(token);
+    return it != children.end() ? it->second : -1;
+  }
+
+private:
+  void build();
+
+  // children of each trie node by token id
+  std::vector<std::map<int, int>> nodes_;
+  std::unordered_map<std::string, std::vector<int>> words_;
+};
+
+#endif  // LEXICON_OVERLAY_H_
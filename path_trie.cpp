@@ -6,7 +6,10 @@
 #include <utility>
 #include <vector>
 
+#include "decoder_stats.h"
 #include "decoder_utils.h"
+#include "detokenizer.h"
+#include "lexicon_overlay.h"
 
 PathTrie::PathTrie() {
   log_prob_b_prev = -NUM_FLT_INF;
@@ -14,6 +17,11 @@ PathTrie::PathTrie() {
   log_prob_b_cur = -NUM_FLT_INF;
   log_prob_nb_cur = -NUM_FLT_INF;
   score = -NUM_FLT_INF;
+  lm_log_prob = 0.0;
+  num_words = 0;
+  bias_state = -1;
+  bias_base = 0.0;
+  bias_score = 0.0;
 
   ROOT_ = -1;
   character = ROOT_;
@@ -23,82 +31,111 @@ PathTrie::PathTrie() {
   dictionary_ = nullptr;
   dictionary_state_ = 0;
   has_dictionary_ = false;
-  offset = 0;
+  offset = -1;
 
   matcher_ = nullptr;
+  overlay_ = nullptr;
+  overlay_state_ = 0;
+  DECODER_STATS_ADD(nodes_created, 1);
 }
 
 PathTrie::~PathTrie() {
-  for (auto child : children_) {
-    delete child.second;
+  // free the subtree with an explicit stack, deep tries would overflow the
+  // call stack if every child destructor recursed
+  std::vector<PathTrie*> stack;
+  for (auto& child : children_) {
+    stack.push_back(child.second);
   }
+  while (!stack.empty()) {
+    PathTrie* node = stack.back();
+    stack.pop_back();
+    for (auto& child : node->children_) {
+      stack.push_back(child.second);
+    }
+    node->children_.clear();
+    delete node;
+  }
+  DECODER_STATS_ADD(nodes_freed, 1);
 }
 
 PathTrie* PathTrie::get_path_trie(int new_char, bool reset) {
-  auto child = children_.begin();
-  for (child = children_.begin(); child != children_.end(); ++child) {
-    if (child->first == new_char) {
-      break;
+  PathTrie* child = children_.find(new_char);
+  if (child != nullptr) {
+    if (!child->exists_) {
+      child->exists_ = true;
+      child->log_prob_b_prev = -NUM_FLT_INF;
+      child->log_prob_nb_prev = -NUM_FLT_INF;
+      child->log_prob_b_cur = -NUM_FLT_INF;
+      child->log_prob_nb_cur = -NUM_FLT_INF;
+      // timestamped anew, not from when it was pruned
+      child->offset = -1;
     }
-  }
-  if (child != children_.end()) {
-    if (!child->second->exists_) {
-      child->second->exists_ = true;
-      child->second->log_prob_b_prev = -NUM_FLT_INF;
-      child->second->log_prob_nb_prev = -NUM_FLT_INF;
-      child->second->log_prob_b_cur = -NUM_FLT_INF;
-      child->second->log_prob_nb_cur = -NUM_FLT_INF;
-    }
-    return (child->second);
+    return child;
   } else {
     if (has_dictionary_) {
-      if (reset){
-        matcher_->SetState(dictionary_->Start());
-      } else {
-        matcher_->SetState(dictionary_state_);
+      // the path may live on in the dictionary, the overlay or both
+      fst::StdVectorFst::StateId dictionary_state =
+          reset ? dictionary_->Start() : dictionary_state_;
+      if (dictionary_state != fst::kNoStateId) {
+        matcher_->SetState(dictionary_state);
+        bool found = matcher_->Find(new_char + 1);
+        DECODER_STATS_ADD(matcher_finds, 1);
+        dictionary_state =
+            found ? matcher_->Value().nextstate : fst::kNoStateId;
       }
-      bool found = matcher_->Find(new_char + 1);
-      if (!found) {
+      int overlay_state = -1;
+      if (overlay_ != nullptr) {
+        overlay_state = reset ? 0 : overlay_state_;
+        if (overlay_state >= 0) {
+          overlay_state = overlay_->next_state(overlay_state, new_char);
+        }
+      }
+      if (dictionary_state == fst::kNoStateId && overlay_state < 0) {
         return nullptr;
       } else {
         PathTrie* new_path = new PathTrie;
         new_path->character = new_char;
         new_path->parent = this;
         new_path->dictionary_ = dictionary_;
-        new_path->dictionary_state_ = matcher_->Value().nextstate;
+        new_path->dictionary_state_ = dictionary_state;
         new_path->has_dictionary_ = true;
         new_path->matcher_ = matcher_;
-        children_.push_back(std::make_pair(new_char, new_path));
+        new_path->overlay_ = overlay_;
+        new_path->overlay_state_ = overlay_state;
+        children_.insert(new_char, new_path);
         return new_path;
       }
     } else {
       PathTrie* new_path = new PathTrie;
       new_path->character = new_char;
       new_path->parent = this;
-      children_.push_back(std::make_pair(new_char, new_path));
+      children_.insert(new_char, new_path);
       return new_path;
     }
   }
 }
 
 PathTrie* PathTrie::get_path_vec2(std::vector<int>& output,
-                                  const std::vector<std::string>& char_list,
                                   std::vector<uint32_t>* timestamps) {
-  if (character == ROOT_) {
-    std::reverse(output.begin(), output.end());
-    if (timestamps) {
-      std::reverse(timestamps->begin(), timestamps->end());
-    }
-    return this;
-  } else {
-    output.push_back(character);
+  // count first so both buffers can be filled from the back in one pass
+  size_t depth = 0;
+  PathTrie* node = this;
+  for (; node->character != ROOT_; node = node->parent) {
+    ++depth;
+  }
+
+  output.resize(depth);
+  if (timestamps) {
+    timestamps->resize(depth);
+  }
+  size_t pos = depth;
+  for (PathTrie* cur = this; cur->character != ROOT_; cur = cur->parent) {
+    output[--pos] = cur->character;
     if (timestamps) {
-      if (timestamps->size() == 0 || output[output.size()-1] == 0 || parent->character == ROOT_ || parent->character == 0) {
-        timestamps->push_back(offset);
-      }
+      (*timestamps)[pos] = cur->offset;
     }
-    return parent->get_path_vec2(output, char_list, timestamps);
   }
+  return node;
 }
 
 
@@ -106,73 +143,90 @@ PathTrie* PathTrie::get_path_vec(std::vector<int>& output,
                                  std::vector<std::string>& char_list,
                                  size_t max_steps,
                                  std::vector<uint32_t>* timestamps) {
-  // TODO 如果当前路径的token为start_token，
-  // output.push_back(token)
-  // return parent
-  if (character == ROOT_ || output.size() == max_steps) {
-    std::reverse(output.begin(), output.end());
+  // walk up to the first token starting a word (without "#" prefix),
+  // the root or max_steps
+  PathTrie* node = this;
+  while (node->character != ROOT_ && output.size() != max_steps) {
+    output.push_back(node->character);
     if (timestamps) {
-      std::reverse(timestamps->begin(), timestamps->end());
+      timestamps->push_back(node->offset);
     }
-    return this;
-  } else {
-    std::string token = char_list[character];
-    if (token.substr(0, 1) != "#") {
-      output.push_back(character);
-      std::reverse(output.begin(), output.end());
-      if (timestamps) {
-        if (timestamps->size() == 0 || output[output.size()-1] == 0 || parent->character == ROOT_ || parent->character == 0) {
-          timestamps->push_back(offset);
-        }
-        std::reverse(timestamps->begin(), timestamps->end());
-      }
-      return parent;
-    } else {
-      output.push_back(character);
-      if (timestamps) {
-        if (timestamps->size() == 0 || output[output.size()-1] == 0 || parent->character == ROOT_ || parent->character == 0) {
-          timestamps->push_back(offset);
-        }
-      }
-      return parent->get_path_vec(output, char_list, max_steps, timestamps);
+    bool word_start = char_list[node->character].compare(0, 1, "#") != 0;
+    node = node->parent;
+    if (word_start) {
+      break;
     }
   }
+  std::reverse(output.begin(), output.end());
+  if (timestamps) {
+    std::reverse(timestamps->begin(), timestamps->end());
+  }
+  return node;
+}
+
+void PathTrie::get_words(
+    const Detokenizer& detokenizer,
+    std::vector<std::tuple<std::string, uint32_t, uint32_t>>& words) const {
+  // walk up once, the words coming out last first; pieces holds the nodes
+  // of the current word, deepest first, until its first token is reached
+  words.clear();
+  std::vector<const PathTrie*> pieces;
+  for (const PathTrie* node = this; node->character != ROOT_;
+       node = node->parent) {
+    pieces.push_back(node);
+    if (!detokenizer.starts_word(node->character) &&
+        node->parent->character != ROOT_) {
+      continue;
+    }
+    std::string text;
+    for (auto piece = pieces.rbegin(); piece != pieces.rend(); ++piece) {
+      detokenizer.append_token((*piece)->character, text);
+    }
+    if (!text.empty()) {
+      words.emplace_back(std::move(text), pieces.back()->offset,
+                         pieces.front()->offset);
+    }
+    pieces.clear();
+  }
+  std::reverse(words.begin(), words.end());
 }
 
 void PathTrie::iterate_to_vec(std::vector<PathTrie*>& output) {
-  if (exists_) {
-    log_prob_b_prev = log_prob_b_cur;
-    log_prob_nb_prev = log_prob_nb_cur;
+  // pre-order traversal with an explicit stack, children pushed in reverse
+  // so they are visited in container order
+  std::vector<PathTrie*> stack(1, this);
+  while (!stack.empty()) {
+    PathTrie* node = stack.back();
+    stack.pop_back();
+    if (node->exists_) {
+      node->log_prob_b_prev = node->log_prob_b_cur;
+      node->log_prob_nb_prev = node->log_prob_nb_cur;
 
-    log_prob_b_cur = -NUM_FLT_INF;
-    log_prob_nb_cur = -NUM_FLT_INF;
+      node->log_prob_b_cur = -NUM_FLT_INF;
+      node->log_prob_nb_cur = -NUM_FLT_INF;
 
-    score = log_sum_exp(log_prob_b_prev, log_prob_nb_prev);
-    output.push_back(this);
-  }
-  for (auto child : children_) {
-    child.second->iterate_to_vec(output);
+      node->score = log_sum_exp(node->log_prob_b_prev, node->log_prob_nb_prev);
+      output.push_back(node);
+    }
+    for (auto child = node->children_.end();
+         child != node->children_.begin();) {
+      --child;
+      stack.push_back(child->second);
+    }
   }
 }
 
 void PathTrie::remove() {
   exists_ = false;
 
-  if (children_.size() == 0) {
-    auto child = parent->children_.begin();
-    for (child = parent->children_.begin(); child != parent->children_.end();
-         ++child) {
-      if (child->first == character) {
-        parent->children_.erase(child);
-        break;
-      }
-    }
-
-    if (parent->children_.size() == 0 && !parent->exists_) {
-      parent->remove();
-    }
-
-    delete this;
+  // delete this node and every ancestor left without children or a prefix
+  PathTrie* node = this;
+  while (node->children_.empty() && !node->exists_ &&
+         node->parent != nullptr) {
+    PathTrie* parent = node->parent;
+    parent->children_.erase(node->character);
+    delete node;
+    node = parent;
   }
 }
 
@@ -187,7 +241,205 @@ void PathTrie::set_matcher(std::shared_ptr<FSTMATCH> matcher) {
   matcher_ = matcher;
 }
 
+void PathTrie::set_lexicon_overlay(const LexiconOverlay* overlay) {
+  overlay_ = overlay;
+}
+
+
+
+
+
+
+PathTrie* PathTrieChildren::find(int character) const {
+  if (spill_ == nullptr) {
+    for (size_t i = 0; i < size_; ++i) {
+      if (inline_[i].first == character) {
+        return inline_[i].second;
+      }
+    }
+    return nullptr;
+  }
+  size_t slot = find_slot(character);
+  return slot < spill_->slots.size()
+             ? spill_->items[spill_->slots[slot]].second
+             : nullptr;
+}
+
+size_t PathTrieChildren::find_slot(int character) const {
+  const auto& items = spill_->items;
+  const auto& slots = spill_->slots;
+  size_t mask = slots.size() - 1;
+  for (size_t slot = home_slot(character); slots[slot] >= 0;
+       slot = (slot + 1) & mask) {
+    if (items[slots[slot]].first == character) {
+      return slot;
+    }
+  }
+  return slots.size();
+}
+
+void PathTrieChildren::insert(int character, PathTrie* child) {
+  if (spill_ == nullptr) {
+    if (size_ < INLINE_CHILDREN) {
+      inline_[size_++] = std::make_pair(character, child);
+      return;
+    }
+    spill_.reset(new Spill);
+    spill_->items.assign(inline_, inline_ + size_);
+    rehash(4 * INLINE_CHILDREN);
+  }
+  auto& items = spill_->items;
+  auto& slots = spill_->slots;
+  items.push_back(std::make_pair(character, child));
+  ++size_;
+  // keep the load factor at most 1/2
+  if (2 * items.size() > slots.size()) {
+    rehash(2 * slots.size());
+  } else {
+    size_t slot = home_slot(character);
+    while (slots[slot] >= 0) {
+      slot = (slot + 1) & (slots.size() - 1);
+    }
+    slots[slot] = items.size() - 1;
+  }
+}
+
+bool PathTrieChildren::erase(int character) {
+  if (spill_ == nullptr) {
+    for (size_t i = 0; i < size_; ++i) {
+      if (inline_[i].first == character) {
+        // shift down, the children being iterated in insertion order
+        std::copy(inline_ + i + 1, inline_ + size_, inline_ + i);
+        --size_;
+        return true;
+      }
+    }
+    return false;
+  }
+  auto& items = spill_->items;
+  auto& slots = spill_->slots;
+  size_t slot = find_slot(character);
+  if (slot == slots.size()) {
+    return false;
+  }
+  size_t pos = slots[slot];
 
+  // backward-shift deletion keeps every probe chain contiguous
+  size_t mask = slots.size() - 1;
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; slots[next] >= 0;
+       next = (next + 1) & mask) {
+    size_t home = home_slot(items[slots[next]].first);
+    // move the entry into the hole unless its home lies in (hole, next]
+    bool stays = hole < next ? (home > hole && home <= next)
+                             : (home > hole || home <= next);
+    if (!stays) {
+      slots[hole] = slots[next];
+      hole = next;
+    }
+  }
+  slots[hole] = -1;
 
+  // shift the later entries down to keep the insertion order
+  items.erase(items.begin() + pos);
+  for (auto& index : slots) {
+    if (index > static_cast<int>(pos)) {
+      --index;
+    }
+  }
+  --size_;
+  return true;
+}
 
+void PathTrieChildren::clear() {
+  spill_.reset();
+  size_ = 0;
+}
 
+void PathTrieChildren::rehash(size_t num_slots) {
+  const auto& items = spill_->items;
+  auto& slots = spill_->slots;
+  slots.assign(num_slots, -1);
+  size_t mask = num_slots - 1;
+  for (size_t i = 0; i < items.size(); ++i) {
+    size_t slot = home_slot(items[i].first);
+    while (slots[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = i;
+  }
+}
+
+void PrefixBeam::load(const std::vector<PathTrie*>& prefixes,
+                      size_t beam_size) {
+  size_t num_prefixes = std::min(prefixes.size(), beam_size);
+  nodes.assign(prefixes.begin(), prefixes.begin() + num_prefixes);
+  score.resize(num_prefixes);
+  character.resize(num_prefixes);
+  log_prob_b_prev.resize(num_prefixes);
+  log_prob_nb_prev.resize(num_prefixes);
+  log_prob_b_cur.assign(num_prefixes, -NUM_FLT_INF);
+  log_prob_nb_cur.assign(num_prefixes, -NUM_FLT_INF);
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    score[i] = nodes[i]->score;
+    character[i] = nodes[i]->character;
+    log_prob_b_prev[i] = nodes[i]->log_prob_b_prev;
+    log_prob_nb_prev[i] = nodes[i]->log_prob_nb_prev;
+  }
+}
+
+void PrefixBeam::update_blank_and_repeat(
+    const std::vector<std::pair<size_t, float>>& log_prob_idx,
+    size_t blank_id,
+    bool full_beam,
+    float min_cutoff) {
+  size_t num_prefixes = size();
+  for (auto& item : log_prob_idx) {
+    if (item.first >= token_log_prob_.size()) {
+      token_log_prob_.resize(item.first + 1, -NUM_FLT_INF);
+    }
+    token_log_prob_[item.first] = item.second;
+  }
+  if (!full_beam) {
+    min_cutoff = -NUM_FLT_INF;
+  }
+
+  // blank, skipped when pruned away
+  if (blank_id < token_log_prob_.size() &&
+      token_log_prob_[blank_id] > -NUM_FLT_INF) {
+    float log_prob_blank = token_log_prob_[blank_id];
+    for (size_t i = 0; i < num_prefixes; ++i) {
+      float log_p = log_prob_blank + score[i];
+      if (log_p >= min_cutoff) {
+        log_prob_b_cur[i] = log_sum_exp(log_prob_b_cur[i], log_p);
+      }
+    }
+  }
+
+  // repeated character
+  for (size_t i = 0; i < num_prefixes; ++i) {
+    int c = character[i];
+    if (c < 0 || static_cast<size_t>(c) >= token_log_prob_.size()) {
+      continue;
+    }
+    float log_prob_c = token_log_prob_[c];
+    if (log_prob_c > -NUM_FLT_INF && log_prob_c + score[i] >= min_cutoff) {
+      log_prob_nb_cur[i] =
+          log_sum_exp(log_prob_nb_cur[i], log_prob_c + log_prob_nb_prev[i]);
+    }
+  }
+
+  for (auto& item : log_prob_idx) {
+    token_log_prob_[item.first] = -NUM_FLT_INF;
+  }
+}
+
+void PrefixBeam::store() {
+  // extensions from other prefixes may already have reached these nodes
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    nodes[i]->log_prob_b_cur =
+        log_sum_exp(nodes[i]->log_prob_b_cur, log_prob_b_cur[i]);
+    nodes[i]->log_prob_nb_cur =
+        log_sum_exp(nodes[i]->log_prob_nb_cur, log_prob_nb_cur[i]);
+  }
+}
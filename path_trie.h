@@ -2,13 +2,80 @@
 #define PATH_TRIE_H
 
 #include <algorithm>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "fst/fstlib.h"
 
+class Detokenizer;
+class LexiconOverlay;
+class PathTrie;
+
+/* Children of a PathTrie node keyed by character.
+ *
+ * Up to INLINE_CHILDREN entries are stored inline in the node and found by
+ * linear scan. Beyond that the entries move to the heap together with an
+ * open-addressing index (linear probing), so lookup at high-fanout nodes
+ * such as the root and word boundaries stays O(1). The heap part hangs off
+ * a single pointer, null for the many nodes that never spill. Entries are
+ * iterated in insertion order, removal shifting the later ones down, so
+ * the beam is built in the same order as with a plain vector.
+ */
+class PathTrieChildren {
+public:
+  typedef std::pair<int, PathTrie*> value_type;
+
+  PathTrieChildren() : size_(0) {}
+
+  // return the child for character, or nullptr if absent
+  PathTrie* find(int character) const;
+
+  // add a child, character must not be present yet
+  void insert(int character, PathTrie* child);
+
+  // remove the child for character, return false if absent
+  bool erase(int character);
+
+  // drop all entries without deleting the children
+  void clear();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const value_type* begin() const { return data(); }
+  const value_type* end() const { return data() + size_; }
+
+private:
+  static const size_t INLINE_CHILDREN = 4;
+
+  // entries beyond INLINE_CHILDREN and their index
+  struct Spill {
+    std::vector<value_type> items;
+    // position in items for each slot, -1 if empty
+    std::vector<int> slots;
+  };
+
+  const value_type* data() const {
+    return spill_ != nullptr ? spill_->items.data() : inline_;
+  }
+  size_t home_slot(int character) const {
+    return (static_cast<uint32_t>(character) * 2654435761u) &
+           (spill_->slots.size() - 1);
+  }
+  // slot holding character in the index, or slots.size() if absent
+  size_t find_slot(int character) const;
+  void rehash(size_t num_slots);
+
+  value_type inline_[INLINE_CHILDREN];
+  std::unique_ptr<Spill> spill_;
+  uint32_t size_;
+};
+
 /* Trie tree for prefix storing and manipulating, with a dictionary in
  * finite-state transducer for spelling correction.
  */
@@ -20,9 +87,10 @@ public:
   // get new prefix after appending new char
   PathTrie* get_path_trie(int new_char, bool reset = true);
 
-  // get the prefix in index from root to current node
-  PathTrie* get_path_vec2(std::vector<int>& output, 
-                          const std::vector<std::string> &char_list,
+  // get the prefix in index from root to current node, output (and the
+  // frame of each token in timestamps) are resized to fit and filled in
+  // place
+  PathTrie* get_path_vec2(std::vector<int>& output,
                           std::vector<uint32_t>* timestamps = nullptr);
 
   // get the prefix in index from some stop node to current nodel
@@ -31,6 +99,13 @@ public:
                          size_t max_steps = std::numeric_limits<size_t>::max(),
                          std::vector<uint32_t>* timestamps = nullptr);
 
+  // get the words of the prefix with the frames of their first and last
+  // tokens, a word being a token without "#" prefix and the "#" tokens
+  // after it. Words without text, such as a lone "▁", are left out.
+  void get_words(
+      const Detokenizer& detokenizer,
+      std::vector<std::tuple<std::string, uint32_t, uint32_t>>& words) const;
+
   // update log probs
   void iterate_to_vec(std::vector<PathTrie*>& output);
 
@@ -39,7 +114,11 @@ public:
 
   void set_matcher(std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>>);
 
-  bool is_empty() { return ROOT_ == character; }
+  // set the runtime words consulted next to the dictionary, which must
+  // outlive the trie
+  void set_lexicon_overlay(const LexiconOverlay* overlay);
+
+  bool is_empty() const { return ROOT_ == character; }
 
   // remove current path from root
   void remove();
@@ -50,7 +129,18 @@ public:
   float log_prob_nb_cur;
   float score;
   float approx_ctc;
+  // sum of the LM log probs and number of the words scored on the path,
+  // set when the search extends to the node
+  float lm_log_prob;
+  int num_words;
+  // contextual biasing state, -1 until a ContextBiasing walks to the node,
+  // and the bias summed over the path, see ContextBiasing
+  int bias_state;
+  float bias_base;
+  float bias_score;
   int character;
+  // frame of the token, set by the search when it creates the node, -1
+  // before
   int offset;
   PathTrie* parent;
 
@@ -59,13 +149,56 @@ private:
   bool exists_;
   bool has_dictionary_;
 
-  std::vector<std::pair<int, PathTrie*>> children_;
+  PathTrieChildren children_;
 
   // pointer to dictionary of FST
   fst::StdVectorFst* dictionary_;
   fst::StdVectorFst::StateId dictionary_state_;
   // true if finding ars in FST
   std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>> matcher_;
+
+  // runtime words, the state being -1 once the path left them
+  const LexiconOverlay* overlay_;
+  int overlay_state_;
+};
+
+/* Structure-of-arrays view of the active beam for one time step.
+ *
+ * The per-frame extension loop reads each prefix's score, last character
+ * and blank / non-blank probabilities from these contiguous arrays rather
+ * than chasing PathTrie pointers, and accumulates the blank and repeated
+ * character updates in place. The trie nodes are only touched to extend a
+ * prefix, and store() writes the accumulated probabilities back to them.
+ */
+class PrefixBeam {
+public:
+  // gather the first beam_size prefixes into the arrays
+  void load(const std::vector<PathTrie*>& prefixes, size_t beam_size);
+
+  // apply the blank and repeated character cases of one time step to all
+  // prefixes in one pass; only extensions are left to the per-token loop
+  void update_blank_and_repeat(
+      const std::vector<std::pair<size_t, float>>& log_prob_idx,
+      size_t blank_id,
+      bool full_beam,
+      float min_cutoff);
+
+  // merge the accumulated current probs back into the trie nodes
+  void store();
+
+  size_t size() const { return nodes.size(); }
+
+  std::vector<PathTrie*> nodes;
+  std::vector<float> score;
+  std::vector<int> character;
+  std::vector<float> log_prob_b_prev;
+  std::vector<float> log_prob_nb_prev;
+  std::vector<float> log_prob_b_cur;
+  std::vector<float> log_prob_nb_cur;
+
+private:
+  // log prob of each token kept after pruning, -inf for the others
+  std::vector<float> token_log_prob_;
 };
 
 #endif  // PATH_TRIE_H
@@ -0,0 +1,144 @@
+#include "posterior_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstring>
+
+#include "decoder_utils.h"
+
+// IEEE half to single precision, including subnormals, inf and nan
+static float half_to_float(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // normalize the subnormal
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+PosteriorFile::PosteriorFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  VALID_CHECK(fd >= 0, "Invalid posterior file path");
+  struct stat st;
+  VALID_CHECK_EQ(fstat(fd, &st), 0, "Cannot stat posterior file");
+  size_ = static_cast<size_t>(st.st_size);
+  VALID_CHECK(size_ >= sizeof(PosteriorFileHeader),
+              "Posterior file is truncated");
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  VALID_CHECK(data_ != MAP_FAILED, "Cannot map posterior file");
+
+  header_ = static_cast<const PosteriorFileHeader *>(data_);
+  VALID_CHECK_EQ(std::memcmp(header_->magic, POSTERIOR_FILE_MAGIC, 8), 0,
+                 "Not a posterior file");
+  VALID_CHECK_EQ(header_->version, POSTERIOR_FILE_VERSION,
+                 "Unsupported posterior file version");
+  VALID_CHECK(header_->dtype == POSTERIOR_FLOAT32 ||
+                  header_->dtype == POSTERIOR_FLOAT16,
+              "Unsupported posterior dtype");
+  VALID_CHECK_GT(header_->num_classes, 0, "Posterior file has no classes");
+  VALID_CHECK(header_->top_k <= header_->num_classes,
+              "top_k exceeds the number of classes");
+
+  entries_ = reinterpret_cast<const PosteriorFileEntry *>(header_ + 1);
+  VALID_CHECK(sizeof(PosteriorFileHeader) +
+                      num_utterances() * sizeof(PosteriorFileEntry) <=
+                  size_,
+              "Posterior file is truncated");
+  size_t value_size = header_->dtype == POSTERIOR_FLOAT16 ? 2 : 4;
+  size_t row_size = is_sparse() ? top_k() * (4 + value_size)
+                                : num_classes() * value_size;
+  for (size_t i = 0; i < num_utterances(); ++i) {
+    VALID_CHECK(entries_[i].offset % 8 == 0,
+                "Misaligned utterance in posterior file");
+    // compared by division, a corrupt entry could wrap the byte count
+    VALID_CHECK(entries_[i].offset <= size_ &&
+                    entries_[i].num_frames <=
+                        (size_ - entries_[i].offset) / row_size,
+                "Posterior file is truncated");
+  }
+}
+
+PosteriorFile::~PosteriorFile() { munmap(data_, size_); }
+
+size_t PosteriorFile::num_frames(size_t utt) const {
+  VALID_CHECK_LT(utt, num_utterances(), "Utterance index out of range");
+  return entries_[utt].num_frames;
+}
+
+double PosteriorFile::value(const char *ptr, size_t i) const {
+  if (header_->dtype == POSTERIOR_FLOAT16) {
+    return half_to_float(reinterpret_cast<const uint16_t *>(ptr)[i]);
+  }
+  return reinterpret_cast<const float *>(ptr)[i];
+}
+
+std::vector<std::vector<double>> PosteriorFile::get_probs(size_t utt) const {
+  size_t num_time_steps = num_frames(utt);
+  const char *ptr = static_cast<const char *>(data_) + entries_[utt].offset;
+  std::vector<std::vector<double>> probs(
+      num_time_steps, std::vector<double>(num_classes(), 0.0));
+  if (!is_sparse()) {
+    for (size_t t = 0; t < num_time_steps; ++t) {
+      for (size_t c = 0; c < num_classes(); ++c) {
+        probs[t][c] = value(ptr, t * num_classes() + c);
+      }
+    }
+    return probs;
+  }
+
+  const uint32_t *ids = reinterpret_cast<const uint32_t *>(ptr);
+  const char *values = ptr + num_time_steps * top_k() * sizeof(uint32_t);
+  for (size_t t = 0; t < num_time_steps; ++t) {
+    for (size_t k = 0; k < top_k(); ++k) {
+      size_t i = t * top_k() + k;
+      VALID_CHECK_LT(ids[i], num_classes(), "Token id out of range");
+      probs[t][ids[i]] = value(values, i);
+    }
+  }
+  return probs;
+}
+
+void PosteriorFile::get_sparse_log_probs(size_t utt,
+                                         std::vector<int> &token_ids,
+                                         std::vector<float> &log_probs,
+                                         std::vector<int> &row_offsets) const {
+  VALID_CHECK(is_sparse(), "Posterior file is not sparse");
+  size_t num_time_steps = num_frames(utt);
+  size_t num_values = num_time_steps * top_k();
+  const char *ptr = static_cast<const char *>(data_) + entries_[utt].offset;
+  const uint32_t *ids = reinterpret_cast<const uint32_t *>(ptr);
+  const char *values = ptr + num_values * sizeof(uint32_t);
+
+  token_ids.resize(num_values);
+  log_probs.resize(num_values);
+  for (size_t i = 0; i < num_values; ++i) {
+    VALID_CHECK_LT(ids[i], num_classes(), "Token id out of range");
+    token_ids[i] = static_cast<int>(ids[i]);
+    // same flooring as get_pruned_log_probs()
+    log_probs[i] = std::log(value(values, i) + NUM_FLT_MIN);
+  }
+  row_offsets.resize(num_time_steps + 1);
+  for (size_t t = 0; t <= num_time_steps; ++t) {
+    row_offsets[t] = static_cast<int>(t * top_k());
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef POSTERIOR_FILE_H_
+#define POSTERIOR_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Binary container of many utterances' posteriors for offline decoding,
+ * written by posterior_file.py.
+ *
+ * Layout, little endian:
+ *     PosteriorFileHeader
+ *     num_utterances x PosteriorFileEntry
+ *     per utterance, 8-byte aligned at its offset:
+ *         dense:  num_frames x num_classes values
+ *         sparse: num_frames x top_k uint32 token ids, then
+ *                 num_frames x top_k values
+ * Values are probabilities in float32 or float16, the blank is the last
+ * class and always kept by the sparse encoding.
+ */
+const char POSTERIOR_FILE_MAGIC[8] = {'C', 'T', 'C', 'P', 'O', 'S', 'T', 0};
+const uint32_t POSTERIOR_FILE_VERSION = 1;
+const uint32_t POSTERIOR_FLOAT32 = 0;
+const uint32_t POSTERIOR_FLOAT16 = 1;
+
+struct PosteriorFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_utterances;
+  uint32_t num_classes;
+  uint32_t dtype;
+  // values kept per frame, 0 for dense frames
+  uint32_t top_k;
+  uint32_t reserved;
+};
+
+struct PosteriorFileEntry {
+  uint64_t offset;
+  uint32_t num_frames;
+  uint32_t reserved;
+};
+
+/* Read-only memory mapped view of a posterior file. Utterances are decoded
+ * from the mapping on demand, so a batch can stream them into decoder
+ * threads without loading the whole file. Safe to share between threads.
+ */
+class PosteriorFile {
+public:
+  explicit PosteriorFile(const std::string &path);
+  ~PosteriorFile();
+
+  size_t num_utterances() const { return header_->num_utterances; }
+  size_t num_classes() const { return header_->num_classes; }
+  size_t num_frames(size_t utt) const;
+  bool is_sparse() const { return header_->top_k > 0; }
+  size_t top_k() const { return header_->top_k; }
+
+  // probabilities of one utterance, densified if stored sparse
+  std::vector<std::vector<double>> get_probs(size_t utt) const;
+
+  // top-k pairs of one utterance in the CSR form taken by
+  // ctc_beam_search_decoder_sparse(), only for sparse files
+  void get_sparse_log_probs(size_t utt,
+                            std::vector<int> &token_ids,
+                            std::vector<float> &log_probs,
+                            std::vector<int> &row_offsets) const;
+
+private:
+  PosteriorFile(const PosteriorFile &);
+  PosteriorFile &operator=(const PosteriorFile &);
+
+  // value i of the data starting at ptr
+  double value(const char *ptr, size_t i) const;
+
+  void *data_;
+  size_t size_;
+  const PosteriorFileHeader *header_;
+  const PosteriorFileEntry *entries_;
+};
+
+#endif  // POSTERIOR_FILE_H_
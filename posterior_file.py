@@ -0,0 +1,73 @@
+"""Writer of the binary posterior container read by PosteriorFile."""
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import struct
+
+import numpy as np
+
+MAGIC = b'CTCPOST\x00'
+VERSION = 1
+DTYPES = {'float32': (0, '<f4'), 'float16': (1, '<f2')}
+HEADER_FORMAT = '<8sIIIIII'
+ENTRY_FORMAT = '<QII'
+
+
+def _align(f, alignment=8):
+    pad = -f.tell() % alignment
+    f.write(b'\x00' * pad)
+
+
+def write_posterior_file(path, probs_split, dtype='float16', top_k=0):
+    """Write the posteriors of many utterances into one file.
+
+    :param path: Output path.
+    :type path: basestring
+    :param probs_split: List of 2-D arrays of probabilities, one per
+                        utterance, each of shape (num_frames, num_classes)
+                        with the blank as last class.
+    :type probs_split: list
+    :param dtype: Storage type of the values, 'float16' or 'float32'.
+    :type dtype: basestring
+    :param top_k: Keep only the top_k most probable classes per frame,
+                  always including the blank. 0 stores dense frames.
+    :type top_k: int
+    """
+    if dtype not in DTYPES:
+        raise ValueError('dtype must be float16 or float32')
+    dtype_id, np_dtype = DTYPES[dtype]
+    probs_split = [np.asarray(probs, dtype=np.float32) for probs in probs_split]
+    if not probs_split:
+        raise ValueError('No utterances to write')
+    num_classes = probs_split[0].shape[1]
+    if any(p.ndim != 2 or p.shape[1] != num_classes for p in probs_split):
+        raise ValueError('All utterances must be 2-D with the same classes')
+    if not 0 <= top_k <= num_classes:
+        raise ValueError('top_k must be in [0, num_classes]')
+    blank_id = num_classes - 1
+
+    with open(path, 'wb') as f:
+        f.write(struct.pack(HEADER_FORMAT, MAGIC, VERSION, len(probs_split),
+                            num_classes, dtype_id, top_k, 0))
+        index_pos = f.tell()
+        f.write(b'\x00' * struct.calcsize(ENTRY_FORMAT) * len(probs_split))
+
+        entries = []
+        for probs in probs_split:
+            _align(f)
+            entries.append((f.tell(), probs.shape[0]))
+            if top_k == 0:
+                f.write(probs.astype(np_dtype).tobytes())
+                continue
+            ids = np.argpartition(-probs, top_k - 1, axis=1)[:, :top_k]
+            # make room for the blank where it was not kept
+            no_blank = ~(ids == blank_id).any(axis=1)
+            ids[no_blank, top_k - 1] = blank_id
+            values = np.take_along_axis(probs, ids, axis=1)
+            f.write(ids.astype('<u4').tobytes())
+            f.write(values.astype(np_dtype).tobytes())
+
+        f.seek(index_pos)
+        for offset, num_frames in entries:
+            f.write(struct.pack(ENTRY_FORMAT, offset, num_frames, 0))
@@ -0,0 +1,122 @@
+#include "rescorer.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include "ThreadPool.h"
+#include "lm/model.hh"
+#include "lm/state.hh"
+
+#include "decoder_utils.h"
+
+Rescorer::Rescorer(double alpha, double beta, const std::string &lm_path)
+    : Scorer(alpha, beta, lm_path) {}
+
+void Rescorer::get_sent_log_probs(const std::vector<std::string> &sentences,
+                                  std::vector<double> &log_probs,
+                                  std::vector<int> &num_words) {
+  const lm::base::Model *model =
+      static_cast<const lm::base::Model *>(language_model_);
+  const lm::base::Vocabulary &vocab = model->BaseVocabulary();
+  size_t num_sentences = sentences.size();
+  std::vector<std::vector<std::string>> words(num_sentences);
+  for (size_t i = 0; i < num_sentences; ++i) {
+    // words of the LM, as split_labels() splits them
+    if (!is_character_based()) {
+      words[i] = split_str(sentences[i], " ");
+    } else if (!sentences[i].empty()) {
+      words[i] = split_utf8_str(sentences[i]);
+    }
+  }
+
+  // visit the sentences in lexicographic order of their words, so that each
+  // one only scores the words after its common prefix with the previous one
+  std::vector<size_t> order(num_sentences);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&words](size_t a, size_t b) {
+    return words[a] < words[b];
+  });
+
+  // LM state and log prob after each word of the previous sentence
+  std::vector<lm::ngram::State> states(1);
+  std::vector<double> prefix_log_probs(1, 0.0);
+  model->BeginSentenceWrite(&states[0]);
+  const std::vector<std::string> *prev = nullptr;
+
+  log_probs.assign(num_sentences, 0.0);
+  num_words.assign(num_sentences, 0);
+  for (size_t i : order) {
+    const std::vector<std::string> &cur = words[i];
+    size_t common = 0;
+    if (prev != nullptr) {
+      while (common < prev->size() && common < cur.size() &&
+             (*prev)[common] == cur[common]) {
+        ++common;
+      }
+    }
+    states.resize(cur.size() + 1);
+    prefix_log_probs.resize(cur.size() + 1);
+    for (size_t j = common; j < cur.size(); ++j) {
+      lm::WordIndex word_index = vocab.Index(cur[j]);
+      double cond_prob =
+          model->BaseScore(&states[j], word_index, &states[j + 1]);
+      // same OOV penalty as the first pass
+      if (word_index == 0) {
+        cond_prob = OOV_SCORE;
+      }
+      prefix_log_probs[j + 1] = prefix_log_probs[j] + cond_prob;
+    }
+    lm::ngram::State end_state;
+    log_probs[i] =
+        prefix_log_probs[cur.size()] +
+        model->BaseScore(&states[cur.size()], vocab.EndSentence(), &end_state);
+    num_words[i] = cur.size();
+    prev = &cur;
+  }
+}
+
+std::vector<std::vector<std::pair<double, std::string>>> Rescorer::rescore(
+    const std::vector<std::vector<std::pair<double, std::string>>>
+        &nbest_split,
+    size_t num_processes) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  size_t batch_size = nbest_split.size();
+  std::vector<std::vector<std::pair<double, std::string>>> results(
+      batch_size);
+
+  // one task per thread over contiguous lists, an N-best list being too
+  // cheap to rescore for a task of its own
+  size_t num_tasks = std::min(num_processes, std::max<size_t>(batch_size, 1));
+  size_t chunk = (batch_size + num_tasks - 1) / num_tasks;
+  ThreadPool pool(num_tasks);
+  std::vector<std::future<void>> res;
+  for (size_t begin = 0; begin < batch_size; begin += chunk) {
+    size_t end = std::min(begin + chunk, batch_size);
+    res.emplace_back(pool.enqueue([&, begin, end]() {
+      std::vector<std::string> sentences;
+      std::vector<double> log_probs;
+      std::vector<int> num_words;
+      for (size_t i = begin; i < end; ++i) {
+        const auto &nbest = nbest_split[i];
+        sentences.clear();
+        for (const auto &hyp : nbest) {
+          sentences.push_back(hyp.second);
+        }
+        get_sent_log_probs(sentences, log_probs, num_words);
+        auto &rescored = results[i];
+        for (size_t j = 0; j < nbest.size(); ++j) {
+          rescored.emplace_back(
+              nbest[j].first + alpha * log_probs[j] + beta * num_words[j],
+              nbest[j].second);
+        }
+        std::stable_sort(rescored.begin(),
+                         rescored.end(),
+                         pair_comp_first_rev<double, std::string>);
+      }
+    }));
+  }
+  for (auto &r : res) {
+    r.get();
+  }
+  return results;
+}
@@ -0,0 +1,41 @@
+#ifndef RESCORER_H_
+#define RESCORER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "scorer.h"
+
+/* Second pass scorer of N-best lists with a larger language model.
+ *
+ * Each hypothesis of an N-best list gets
+ *     new_score = base + alpha * lm + beta * num_words
+ * where lm is the log10 prob of the whole sentence, from <s> to </s>, under
+ * the rescoring model. base is the score given with the hypothesis: its
+ * acoustic score (HypothesisScore::acoustic) to replace the first pass LM,
+ * or the first pass score to interpolate with it.
+ *
+ * Example:
+ *     Rescorer rescorer(alpha, beta, "path_of_large_language_model");
+ *     rescorer.rescore(ctc_beam_search_decoder_batch(...), num_processes);
+ */
+class Rescorer : public Scorer {
+public:
+  Rescorer(double alpha, double beta, const std::string &lm_path);
+
+  // sentence log10 prob and number of words of each sentence, sharing the
+  // LM states of the prefixes common to several sentences
+  void get_sent_log_probs(const std::vector<std::string> &sentences,
+                          std::vector<double> &log_probs,
+                          std::vector<int> &num_words);
+
+  // rescore every N-best list of a batch and sort it by the new scores,
+  // the lists being split across num_processes threads
+  std::vector<std::vector<std::pair<double, std::string>>> rescore(
+      const std::vector<std::vector<std::pair<double, std::string>>>
+          &nbest_split,
+      size_t num_processes = 1);
+};
+
+#endif  // RESCORER_H_
@@ -1,6 +1,8 @@
 #include "scorer.h"
 
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
 #include "lm/config.hh"
@@ -9,15 +11,38 @@
 #include "util/string_piece.hh"
 #include "util/tokenize_piece.hh"
 
+#include "ThreadPool.h"
+#include "decoder_stats.h"
 #include "decoder_utils.h"
 
 using namespace lm::ngram;
 
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+}  // namespace
+
+ScorerLoadStats::ScorerLoadStats()
+    : lm_seconds(0.0),
+      words_seconds(0.0),
+      lexicon_seconds(0.0),
+      fst_seconds(0.0),
+      total_seconds(0.0),
+      num_lm_words(0),
+      num_map_words(0),
+      num_lexicon_words(0) {}
+
 Scorer::Scorer(double alpha,
                double beta,
                const std::string& lm_path,
                const std::string& word_path,
-               const std::vector<std::string>& vocab_list) {
+               const std::vector<std::string>& vocab_list,
+               size_t num_processes,
+               bool verbose) {
   this->alpha = alpha;
   this->beta = beta;
 
@@ -28,8 +53,21 @@ Scorer::Scorer(double alpha,
   max_order_ = 0;
   dict_size_ = 0;
 
-  load_words(word_path);
-  setup(lm_path, vocab_list);
+  setup(lm_path, word_path, vocab_list, num_processes, verbose);
+}
+
+Scorer::Scorer(double alpha, double beta, const std::string& lm_path) {
+  this->alpha = alpha;
+  this->beta = beta;
+
+  dictionary = nullptr;
+  is_character_based_ = true;
+  language_model_ = nullptr;
+
+  max_order_ = 0;
+  dict_size_ = 0;
+
+  load_lm(lm_path);
 }
 
 Scorer::~Scorer() {
@@ -42,38 +80,52 @@ Scorer::~Scorer() {
 }
 
 void Scorer::load_words(const std::string& word_path) {
-  //const char* filename = word_path.c_str();
-  //VALID_CHECK_EQ(access(filename, F_OK), 0, "Invalid language model path");
-  word_map_.clear();
-  //std::ifstream inFile(filename);
-  std::ifstream inFile(word_path);
-  if(inFile.is_open()) {
-    std::string str;
-    while(!inFile.eof()) {
-      getline(inFile, str, '\n');
-      if(str.length() == 0) {
-        continue;
-      }
-      std::vector<std::string> splitted = split_str(str, " ");
-      //std::vector<std::string> pieces(splitted.begin() + 1, splitted.end());
-      //word_map_[splitted.at(0)] = splitted;
-      if (splitted.size() > 1) {
-        std::vector<std::string> pieces(splitted.begin() + 1, splitted.end());
-	word_map_[splitted[0]] = pieces;
-      }
-    }
-  }
+  word_map_.load(word_path, detokenizer_);
 }
 
 void Scorer::setup(const std::string& lm_path,
-                   const std::vector<std::string>& vocab_list) {
-  // load language model
-  load_lm(lm_path);
-  // set char map for scorer
+                   const std::string& word_path,
+                   const std::vector<std::string>& vocab_list,
+                   size_t num_processes,
+                   bool verbose) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  auto start = std::chrono::steady_clock::now();
+  ThreadPool pool(num_processes);
+
+  // load language model on the pool, the word map and the char map don't
+  // depend on it
+  auto lm_loaded = pool.enqueue([this, &lm_path, verbose]() {
+    auto lm_start = std::chrono::steady_clock::now();
+    load_lm(lm_path);
+    load_stats_.lm_seconds = seconds_since(lm_start);
+    load_stats_.num_lm_words = vocabulary_.size();
+    if (verbose) {
+      std::cerr << "Scorer: loaded " << max_order_ << "-gram LM with "
+                << vocabulary_.size() << " words in "
+                << load_stats_.lm_seconds << "s" << std::endl;
+    }
+  });
+  // set char map for scorer, the word map is read into its token ids
   set_char_map(vocab_list);
+  auto words_start = std::chrono::steady_clock::now();
+  load_words(word_path);
+  load_stats_.words_seconds = seconds_since(words_start);
+  load_stats_.num_map_words = word_map_.size();
+  if (verbose) {
+    std::cerr << "Scorer: read " << word_map_.size() << " word map entries in "
+              << load_stats_.words_seconds << "s" << std::endl;
+  }
+  lm_loaded.get();
+
   // fill the dictionary for FST
   if (!is_character_based()) {
-    fill_dictionary();
+    fill_dictionary(pool, num_processes, verbose);
+  }
+  word_map_.clear();
+  load_stats_.total_seconds = seconds_since(start);
+  if (verbose) {
+    std::cerr << "Scorer: ready in " << load_stats_.total_seconds << "s"
+              << std::endl;
   }
 }
 
@@ -97,6 +149,14 @@ void Scorer::load_lm(const std::string& lm_path) {
 }
 
 double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
+  auto overlay = get_lexicon_overlay();
+  return get_log_cond_prob(words, overlay.get());
+}
+
+double Scorer::get_log_cond_prob(const std::vector<std::string>& words,
+                                 const LexiconOverlay* lexicon_overlay) {
+  DECODER_STATS_TIMER(lm_seconds);
+  DECODER_STATS_ADD(lm_calls, 1);
   lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
   double cond_prob;
   lm::ngram::State state, tmp_state, out_state;
@@ -104,8 +164,9 @@ double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
   model->NullContextWrite(&state);
   for (size_t i = 0; i < words.size(); ++i) {
     lm::WordIndex word_index = model->BaseVocabulary().Index(words[i]);
-    // encounter OOV
-    if (word_index == 0) {
+    // encounter OOV, words added at runtime score as <unk>
+    if (word_index == 0 && (lexicon_overlay == nullptr ||
+                            !lexicon_overlay->contains(words[i]))) {
       return OOV_SCORE;
     }
     cond_prob = model->BaseScore(&state, word_index, &out_state);
@@ -135,11 +196,12 @@ double Scorer::get_sent_log_prob(const std::vector<std::string>& words) {
 
 double Scorer::get_log_prob(const std::vector<std::string>& words) {
   assert(words.size() > max_order_);
+  auto overlay = get_lexicon_overlay();
   double score = 0.0;
   for (size_t i = 0; i < words.size() - max_order_ + 1; ++i) {
     std::vector<std::string> ngram(words.begin() + i,
                                    words.begin() + i + max_order_);
-    score += get_log_cond_prob(ngram);
+    score += get_log_cond_prob(ngram, overlay.get());
   }
   return score;
 }
@@ -150,21 +212,7 @@ void Scorer::reset_params(float alpha, float beta) {
 }
 
 std::string Scorer::vec2str(const std::vector<int>& input) {
-  std::string word;
-  for (int i = 0; i < input.size(); ++i) {
-    int ind = input[i];
-    if (char_list_[ind].substr(0, 1) == "#") {
-      word += char_list_[ind].substr(2);
-    } else {
-      if (i != 0) {
-        word += " ";
-      }
-      if (char_list_[ind] != "▁") {
-        word += char_list_[ind];
-      }
-    }
-  }
-  return word;
+  return detokenizer_.detokenize(input);
 }
 
 std::vector<std::string> Scorer::split_labels(const std::vector<int>& labels) {
@@ -182,12 +230,9 @@ std::vector<std::string> Scorer::split_labels(const std::vector<int>& labels) {
 
 void Scorer::set_char_map(const std::vector<std::string>& char_list) {
   char_list_ = char_list;
-  char_map_.clear();
-
-  // Set the char map for the FST for spelling correction
-  for (size_t i = 0; i < char_list_.size(); i++) {
-    char_map_[char_list_[i]] = i + 1;
-  }
+  // the pieces of the word map are looked up in the detokenizer for the
+  // FST labels, the token ids shifted by one
+  detokenizer_ = Detokenizer(char_list_);
 }
 
 std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
@@ -224,40 +269,182 @@ std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
   return ngram;
 }
 
-void Scorer::fill_dictionary() {
-  fst::StdVectorFst dictionary;
-  // For each unigram convert to ints and put in trie
-  int dict_size = 0;
-  for (const auto& word : vocabulary_) {
-    if (word_map_.find(word) != word_map_.end()) {
-      bool added = add_word_to_dictionary(word, word_map_[word], char_map_, &dictionary);
-      dict_size += added ? 1 : 0;
-    }
+bool Scorer::add_word(const std::string& word,
+                      const std::vector<std::string>& pieces) {
+  std::vector<int> labels;
+  if (dictionary == nullptr || pieces.empty() ||
+      !word_tokens_to_labels(pieces, detokenizer_, labels)) {
+    return false;
   }
-  dict_size_ = dict_size;
+  // labels are token ids shifted by one for the FST
+  for (auto& label : labels) {
+    label -= 1;
+  }
+  std::lock_guard<std::mutex> lock(lexicon_overlay_mutex_);
+  auto overlay = lexicon_overlay_ != nullptr
+                     ? std::make_shared<LexiconOverlay>(*lexicon_overlay_)
+                     : std::make_shared<LexiconOverlay>();
+  overlay->add_word(word, labels);
+  lexicon_overlay_ = overlay;
+  return true;
+}
 
-  /* Simplify FST
+bool Scorer::remove_word(const std::string& word) {
+  std::lock_guard<std::mutex> lock(lexicon_overlay_mutex_);
+  if (lexicon_overlay_ == nullptr || !lexicon_overlay_->contains(word)) {
+    return false;
+  }
+  auto overlay = std::make_shared<LexiconOverlay>(*lexicon_overlay_);
+  overlay->remove_word(word);
+  if (overlay->size() == 0) {
+    overlay = nullptr;
+  }
+  lexicon_overlay_ = overlay;
+  return true;
+}
+
+size_t Scorer::get_num_added_words() const {
+  auto overlay = get_lexicon_overlay();
+  return overlay != nullptr ? overlay->size() : 0;
+}
 
-   * This gets rid of "epsilon" transitions in the FST.
-   * These are transitions that don't require a string input to be taken.
-   * Getting rid of them is necessary to make the FST determinisitc, but
-   * can greatly increase the size of the FST
+std::shared_ptr<const LexiconOverlay> Scorer::get_lexicon_overlay() const {
+  std::lock_guard<std::mutex> lock(lexicon_overlay_mutex_);
+  return lexicon_overlay_;
+}
+
+void Scorer::fill_dictionary(ThreadPool& pool,
+                             size_t num_shards,
+                             bool verbose) {
+  typedef std::vector<std::vector<int>> Shard;
+  auto lexicon_start = std::chrono::steady_clock::now();
+
+  /* Look up the labels of the LM unigrams in the word map, each task a
+   * contiguous range of the LM vocabulary. The labels are bucketed by their
+   * first label so a shard's words share no arc out of the start state with
+   * another shard's.
    */
-  fst::RmEpsilon(&dictionary);
-  fst::StdVectorFst* new_dict = new fst::StdVectorFst;
+  size_t num_words = vocabulary_.size();
+  size_t num_tasks = std::min(num_shards, std::max<size_t>(num_words, 1));
+  size_t chunk = (num_words + num_tasks - 1) / num_tasks;
+  std::vector<std::vector<Shard>> buckets(num_tasks,
+                                          std::vector<Shard>(num_shards));
+  std::vector<size_t> task_sizes(num_tasks, 0);
+  std::vector<std::future<void>> res;
+  for (size_t task = 0; task < num_tasks; ++task) {
+    res.emplace_back(pool.enqueue([&, task]() {
+      size_t end = std::min((task + 1) * chunk, num_words);
+      for (size_t i = task * chunk; i < end; ++i) {
+        size_t num_labels;
+        const int* labels = word_map_.find(vocabulary_[i], &num_labels);
+        if (labels == nullptr) {
+          continue;
+        }
+        buckets[task][labels[0] % num_shards].emplace_back(
+            labels, labels + num_labels);
+        task_sizes[task] += 1;
+      }
+    }));
+  }
+  for (auto& r : res) {
+    r.get();
+  }
+  res.clear();
 
-  /* This makes the FST deterministic, meaning for any string input there's
-   * only one possible state the FST could be in.  It is assumed our
-   * dictionary is deterministic when using it.
-   * (lest we'd have to check for multiple transitions at each state)
+  /* Each shard sorted and deduplicated is emitted as a trie of its own,
+   * which is deterministic as built: a word shares the states of its common
+   * prefix with the word before it and branches below.
    */
-  fst::Determinize(dictionary, new_dict);
+  std::vector<fst::StdVectorFst> tries(num_shards);
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    res.emplace_back(pool.enqueue([&, shard]() {
+      Shard words;
+      for (auto& task_buckets : buckets) {
+        auto& bucket = task_buckets[shard];
+        words.insert(words.end(),
+                     std::make_move_iterator(bucket.begin()),
+                     std::make_move_iterator(bucket.end()));
+        Shard().swap(bucket);
+      }
+      std::sort(words.begin(), words.end());
+      words.erase(std::unique(words.begin(), words.end()), words.end());
+
+      fst::StdVectorFst& trie = tries[shard];
+      std::vector<fst::StdVectorFst::StateId> path(1, trie.AddState());
+      trie.SetStart(path[0]);
+      const std::vector<int>* prev = nullptr;
+      for (const auto& word : words) {
+        size_t common = 0;
+        if (prev != nullptr) {
+          while (common < prev->size() && common < word.size() &&
+                 (*prev)[common] == word[common]) {
+            ++common;
+          }
+        }
+        path.resize(common + 1);
+        for (size_t i = common; i < word.size(); ++i) {
+          fst::StdVectorFst::StateId dst = trie.AddState();
+          trie.AddArc(path.back(),
+                      fst::StdArc(word[i], word[i],
+                                  fst::StdArc::Weight::One(), dst));
+          path.push_back(dst);
+        }
+        trie.SetFinal(path.back(), fst::StdArc::Weight::One());
+        prev = &word;
+      }
+    }));
+  }
+  for (auto& r : res) {
+    r.get();
+  }
+  size_t dict_size = 0;
+  for (auto size : task_sizes) {
+    dict_size += size;
+  }
+  dict_size_ = dict_size;
+  load_stats_.num_lexicon_words = dict_size;
+  load_stats_.lexicon_seconds = seconds_since(lexicon_start);
+  if (verbose) {
+    std::cerr << "Scorer: mapped " << dict_size << " lexicon words over "
+              << num_shards << " shards in " << load_stats_.lexicon_seconds
+              << "s" << std::endl;
+  }
+
+  // graft the tries under one start state, their first labels disjoint
+  auto fst_start = std::chrono::steady_clock::now();
+  fst::StdVectorFst* new_dict = new fst::StdVectorFst;
+  new_dict->SetStart(new_dict->AddState());
+  for (auto& trie : tries) {
+    fst::StdVectorFst::StateId offset = new_dict->NumStates() - 1;
+    for (fst::StdVectorFst::StateId s = 1; s < trie.NumStates(); ++s) {
+      new_dict->AddState();
+    }
+    for (fst::StdVectorFst::StateId s = 0; s < trie.NumStates(); ++s) {
+      fst::StdVectorFst::StateId state = s == 0 ? 0 : s + offset;
+      new_dict->SetFinal(state, trie.Final(s));
+      for (fst::ArcIterator<fst::StdVectorFst> aiter(trie, s); !aiter.Done();
+           aiter.Next()) {
+        fst::StdArc arc = aiter.Value();
+        arc.nextstate += offset;
+        new_dict->AddArc(state, arc);
+      }
+    }
+    trie.DeleteStates();
+  }
 
   /* Finds the simplest equivalent fst. This is unnecessary but decreases
-   * memory usage of the dictionary
+   * memory usage of the dictionary. The grafted start state has its arcs in
+   * shard order, so they are sorted explicitly for the SortedMatcher rather
+   * than relying on Minimize sorting acyclic input.
    */
   fst::Minimize(new_dict);
+  fst::ArcSort(new_dict, fst::ILabelCompare<fst::StdArc>());
   this->dictionary = new_dict;
+  load_stats_.fst_seconds = seconds_since(fst_start);
+  if (verbose) {
+    std::cerr << "Scorer: built dictionary FST with " << new_dict->NumStates()
+              << " states in " << load_stats_.fst_seconds << "s" << std::endl;
+  }
 }
 
 
@@ -2,6 +2,7 @@
 #define SCORER_H_
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -11,7 +12,12 @@
 #include "lm/word_index.hh"
 #include "util/string_piece.hh"
 
+#include "detokenizer.h"
+#include "lexicon_overlay.h"
 #include "path_trie.h"
+#include "word_map.h"
+
+class ThreadPool;
 
 const double OOV_SCORE = -1000.0;
 const std::string START_TOKEN = "<s>";
@@ -30,6 +36,27 @@ public:
   std::vector<std::string> vocabulary;
 };
 
+/* Stage timings in seconds and sizes of a Scorer's construction. The LM
+ * loads while the word map is read, so total_seconds is less than the sum
+ * of the stages.
+ */
+struct ScorerLoadStats {
+  ScorerLoadStats();
+
+  // loading the LM and enumerating its vocabulary
+  double lm_seconds;
+  // reading the word map into token ids
+  double words_seconds;
+  // collecting the lexicon words' labels and sorting them, sharded
+  double lexicon_seconds;
+  // building the dictionary FST from the shards and minimizing it
+  double fst_seconds;
+  double total_seconds;
+  size_t num_lm_words;
+  size_t num_map_words;
+  size_t num_lexicon_words;
+};
+
 /* External scorer to query score for n-gram or sentence, including language
  * model scoring and word insertion.
  *
@@ -40,13 +67,24 @@ public:
  */
 class Scorer {
 public:
+  // num_processes threads share the loading, and verbose reports each
+  // stage on stderr as it completes
   Scorer(double alpha,
          double beta,
          const std::string &lm_path,
          const std::string &word_path,
-         const std::vector<std::string> &vocabulary);
+         const std::vector<std::string> &vocabulary,
+         size_t num_processes = 1,
+         bool verbose = false);
   ~Scorer();
+  // words added at runtime score as <unk>, as of the current lexicon
   double get_log_cond_prob(const std::vector<std::string> &words);
+#ifndef SWIG
+  // the same against the runtime words of lexicon_overlay, the snapshot a
+  // search holds, so its scores don't change mid-search; nullptr for none
+  double get_log_cond_prob(const std::vector<std::string> &words,
+                           const LexiconOverlay *lexicon_overlay);
+#endif
   double get_sent_log_prob(const std::vector<std::string> &words);
 
   // return the max order
@@ -58,12 +96,33 @@ public:
   // retrun true if the language model is character based
   bool is_character_based() const { return is_character_based_; }
 
+  // timings and sizes of the construction
+  ScorerLoadStats get_load_stats() const { return load_stats_; }
+
   // reset params alpha & beta
   void reset_params(float alpha, float beta);
 
   // make ngram for a given prefix
   std::vector<std::string> make_ngram(PathTrie *prefix);
 
+  // add word, spelled by its pieces as in the word map, to the lexicon of
+  // the decodes started from now on, without rebuilding the dictionary.
+  // Words out of the LM vocabulary score as <unk>. Return false if a piece
+  // is not in the vocabulary or the scorer has no lexicon.
+  bool add_word(const std::string &word,
+                const std::vector<std::string> &pieces);
+
+  // remove a word added by add_word(), return false if absent
+  bool remove_word(const std::string &word);
+
+  // number of the words added by add_word()
+  size_t get_num_added_words() const;
+
+#ifndef SWIG
+  // the words added at runtime, nullptr if none
+  std::shared_ptr<const LexiconOverlay> get_lexicon_overlay() const;
+#endif
+
   // trransform the labels in index to the vector of words (word based lm) or
   // the vector of characters (character based lm)
   std::vector<std::string> split_labels(const std::vector<int> &labels);
@@ -76,20 +135,27 @@ public:
   // pointer to the dictionary of FST
   void *dictionary;
 
-  // word and subword map
-  std::unordered_map<std::string, std::vector<std::string> > word_map_;
-  void load_words(const std::string &word_path);
-
 protected:
-  // necessary setup: load language model, set char map, fill FST's dictionary
+  // load the language model only, for scorers without a decoding lexicon
+  Scorer(double alpha, double beta, const std::string &lm_path);
+
+  // necessary setup: load language model, set char map, read the word map,
+  // fill FST's dictionary; the language model loads while the word map is
+  // read
   void setup(const std::string &lm_path,
-             const std::vector<std::string> &vocab_list);
+             const std::string &word_path,
+             const std::vector<std::string> &vocab_list,
+             size_t num_processes,
+             bool verbose);
 
   // load language model from given path
   void load_lm(const std::string &lm_path);
 
-  // fill dictionary for FST
-  void fill_dictionary();
+  // read the word map, spelled with the char map
+  void load_words(const std::string &word_path);
+
+  // fill dictionary for FST, the lexicon sharded over pool by first token
+  void fill_dictionary(ThreadPool &pool, size_t num_shards, bool verbose);
 
   // set char map
   void set_char_map(const std::vector<std::string> &char_list);
@@ -99,16 +165,25 @@ protected:
   // translate the vector in index to string
   std::string vec2str(const std::vector<int> &input);
   
-private:
+  // the KenLM lm::base::Model
   void *language_model_;
+
+private:
   bool is_character_based_;
   size_t max_order_;
   size_t dict_size_;
+  ScorerLoadStats load_stats_;
 
   std::vector<std::string> char_list_;
-  std::unordered_map<std::string, int> char_map_;
+  Detokenizer detokenizer_;
+  // emptied once the dictionary is built
+  WordMap word_map_;
 
   std::vector<std::string> vocabulary_;
+
+  // replaced on every change, guarded by lexicon_overlay_mutex_
+  std::shared_ptr<const LexiconOverlay> lexicon_overlay_;
+  mutable std::mutex lexicon_overlay_mutex_;
 };
 
 #endif  // SCORER_H_
@@ -16,6 +16,14 @@ parser.add_argument(
     default=1,
     type=int,
     help="Number of cpu processes to build package. (default: %(default)d)")
+parser.add_argument(
+    "--fast_log_sum_exp",
+    action="store_true",
+    help="Use the table approximation of log_sum_exp in the decoders.")
+parser.add_argument(
+    "--decoder_stats",
+    action="store_true",
+    help="Collect per-stage counters and timings in the decoders.")
 args = parser.parse_known_args()
 
 # reconstruct sys.argv to pass to setup below
@@ -86,6 +94,12 @@ if platform.system() != 'Darwin':
 ARGS = ['-O3', '-DKENLM_MAX_ORDER=6', '-std=c++11']
 # ARGS = ['-O0', '-DNDEBUG', '-DKENLM_MAX_ORDER=6', '-std=c++11']
 
+if args[0].fast_log_sum_exp:
+    ARGS.append('-DFAST_LOG_SUM_EXP')
+
+if args[0].decoder_stats:
+    ARGS.append('-DDECODER_STATS')
+
 if compile_test('zlib.h', 'z'):
     ARGS.append('-DHAVE_ZLIB')
     LIBS.append('z')
@@ -120,4 +134,4 @@ setup(
     version='1.1',
     description="""CTC decoders""",
     ext_modules=decoders_module,
-    py_modules=['ctc_decoders', 'swig_decoders'], )
+    py_modules=['ctc_decoders', 'swig_decoders', 'posterior_file'], )
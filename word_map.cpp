@@ -0,0 +1,128 @@
+#include "word_map.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#include "decoder_utils.h"
+#include "detokenizer.h"
+
+WordMap::WordMap() : data_(nullptr), size_(0) {}
+
+WordMap::~WordMap() { clear(); }
+
+size_t WordMap::KeyHash::operator()(const Key &key) const {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size; ++i) {
+    hash ^= static_cast<unsigned char>(key.data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return static_cast<size_t>(hash);
+}
+
+bool WordMap::KeyEqual::operator()(const Key &x, const Key &y) const {
+  return x.size == y.size && std::memcmp(x.data, y.data, x.size) == 0;
+}
+
+void WordMap::load(const std::string &path, const Detokenizer &detokenizer) {
+  clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  VALID_CHECK_EQ(fstat(fd, &st), 0, "Cannot stat word map");
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ == 0) {
+    close(fd);
+    return;
+  }
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  VALID_CHECK(data_ != MAP_FAILED, "Cannot map word map");
+  madvise(data_, size_, MADV_SEQUENTIAL);
+
+  const char *begin = static_cast<const char *>(data_);
+  const char *end = begin + size_;
+  entries_.reserve(std::count(begin, end, '\n') + 1);
+  std::string piece;
+  while (begin < end) {
+    const char *line_end =
+        static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    // fields are separated by runs of spaces, the first is the word
+    Key word = {nullptr, 0};
+    Entry entry = {static_cast<uint32_t>(labels_.size()), 0};
+    bool spelled = true;
+    const char *field = begin;
+    while (field < line_end) {
+      if (*field == ' ') {
+        ++field;
+        continue;
+      }
+      const char *field_end = field;
+      while (field_end < line_end && *field_end != ' ') {
+        ++field_end;
+      }
+      if (word.data == nullptr) {
+        word.data = field;
+        word.size = field_end - field;
+      } else {
+        entry.size += 1;
+        piece.assign(field, field_end);
+        int token = detokenizer.piece_to_token(piece);
+        spelled = spelled && token >= 0;
+        if (spelled) {
+          labels_.push_back(token + 1);
+        }
+      }
+      field = field_end;
+    }
+    begin = line_end + 1;
+    // lines without pieces are skipped
+    if (entry.size == 0) {
+      continue;
+    }
+    if (!spelled) {
+      labels_.resize(entry.offset);
+      entry.size = 0;
+    }
+    entries_[word] = entry;
+  }
+}
+
+void WordMap::clear() {
+  std::unordered_map<Key, Entry, KeyHash, KeyEqual>().swap(entries_);
+  std::vector<int>().swap(labels_);
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+const int *WordMap::find(const std::string &word, size_t *num_labels) const {
+  Key key = {word.data(), word.size()};
+  auto it = entries_.find(key);
+  if (it == entries_.end() || it->second.size == 0) {
+    return nullptr;
+  }
+  *num_labels = it->second.size;
+  return labels_.data() + it->second.offset;
+}
+
+std::vector<int> WordMap::get_tokens(const std::string &word) const {
+  size_t num_labels = 0;
+  const int *labels = find(word, &num_labels);
+  std::vector<int> tokens(num_labels);
+  for (size_t i = 0; i < num_labels; ++i) {
+    tokens[i] = labels[i] - 1;
+  }
+  return tokens;
+}
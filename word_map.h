@@ -0,0 +1,71 @@
+#ifndef WORD_MAP_H_
+#define WORD_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Detokenizer;
+
+/* Decoding lexicon of a Scorer read from its word map file, a word and its
+ * pieces per line separated by spaces, e.g. "hello ▁he llo".
+ *
+ * The file is memory mapped and parsed in place: words are kept as views
+ * into the mapping and their pieces straight as FST labels, so a line
+ * allocates nothing but its labels. Only needed while the dictionary FST is
+ * built, after which clear() releases the mapping.
+ */
+class WordMap {
+public:
+  WordMap();
+  ~WordMap();
+
+  // map and parse the file at path, replacing the current entries; a word
+  // listed again replaces its earlier spelling, a missing file leaves the
+  // map empty
+  void load(const std::string &path, const Detokenizer &detokenizer);
+
+  // drop the entries and unmap the file
+  void clear();
+
+  size_t size() const { return entries_.size(); }
+
+#ifndef SWIG
+  // labels of word, token ids shifted by one for the FST; nullptr if word
+  // is absent or spelled with a piece not in the vocabulary
+  const int *find(const std::string &word, size_t *num_labels) const;
+#endif
+
+  // token ids of word, empty where find() gives nullptr
+  std::vector<int> get_tokens(const std::string &word) const;
+
+private:
+  WordMap(const WordMap &);
+  WordMap &operator=(const WordMap &);
+
+  // a word in the mapping
+  struct Key {
+    const char *data;
+    size_t size;
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+  struct KeyEqual {
+    bool operator()(const Key &x, const Key &y) const;
+  };
+  // labels_[offset, offset + size), size 0 if the word can't be spelled
+  struct Entry {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  std::unordered_map<Key, Entry, KeyHash, KeyEqual> entries_;
+  std::vector<int> labels_;
+  void *data_;
+  size_t size_;
+};
+
+#endif  // WORD_MAP_H_